@@ -24,14 +24,25 @@
 
 #include <gtk/gtk.h>
 
+#include "batch.h"
+#include "datastructs.h"
 #include "hijack.h"
+#include "icons.h"
+#include "platform.h"
 #include "support.h"
 
 G_MODULE_EXPORT void gtk_module_init(gint *argc, gchar ***argv)
 {
 	if (gtk_module_should_run())
 	{
+		session_bus_init();
+		window_export_signals_init();
 		watch_registrar_dbus();
+#ifdef GDK_WINDOWING_WAYLAND
+		appmenu_wl_init();
+#endif
+		module_statistics_add(icons_log_statistics);
+		module_statistics_add(batch_log_statistics);
 		store_pre_hijacked();
 		hijack_menu_bar_class_vtable(GTK_TYPE_MENU_BAR);
 	}
@@ -0,0 +1,318 @@
+/*
+ * appmenu-gtk-module
+ * Copyright 2012 Canonical Ltd.
+ * Copyright (C) 2015-2017 Konstantin Pugin <ria.freelander@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: Ryan Lortie <desrt@desrt.ca>
+ *          William Hua <william.hua@canonical.com>
+ *          Konstantin Pugin <ria.freelander@gmail.com>
+ *          Lester Carballo Perez <lestcape@gmail.com>
+ */
+
+#include "batch.h"
+#include "consts.h"
+#include "support.h"
+
+#include <stdbool.h>
+
+/*
+ * Property changes of exported items are held back for one batching window
+ * (APPMENU_GTK_BATCH_MS, by default until the main loop is idle) and then
+ * forwarded to the DbusmenuServer at once, so it sends them in a single
+ * ItemsPropertiesUpdated. A property set several times in one window is sent
+ * once with its latest value, and not at all if that is the value last sent.
+ *
+ * A consumer reading the menu inside a window would see values that were
+ * never sent, and miss a later change back to the value last sent. So a
+ * dbusmenu read method call flushes the pending changes before it is
+ * dispatched.
+ *
+ * This relies on our "property-changed" handler running before the one of
+ * the server, i.e. on batch_track_item() being called before the item is
+ * added to an exported parent.
+ */
+
+#define BATCH_ITEM "appmenu-gtk-batch-item"
+
+typedef struct
+{
+	/* Property name to the value last forwarded to the server */
+	GHashTable *sent;
+	/* Names of the properties changed in the current window */
+	GHashTable *changed;
+} BatchItem;
+
+static GHashTable *batch_pending = NULL;
+static guint batch_source_id     = 0;
+
+/* The change being forwarded, any other one made by its handlers is batched */
+static DbusmenuMenuitem *batch_emitting_item = NULL;
+static const char *batch_emitting_name       = NULL;
+static GVariant *batch_emitting_value        = NULL;
+
+/* Set from the GDBus thread when a read is waiting for the flush */
+static gint batch_read_flush_queued = 0;
+static guint batch_read_filter_id   = 0;
+
+static guint batch_properties_batched = 0;
+static guint batch_properties_forwarded = 0;
+static guint batch_flushes            = 0;
+static guint batch_layout_batched     = 0;
+static guint batch_layout_emitted     = 0;
+
+G_GNUC_INTERNAL guint batch_get_window_ms(void)
+{
+	static int window_ms = -1;
+
+	if (window_ms < 0)
+		window_ms = (int)module_env_get_uint(BATCH_WINDOW_ENV, BATCH_WINDOW_DEFAULT);
+
+	return (guint)window_ms;
+}
+
+static bool batch_value_equal(GVariant *a, GVariant *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	return g_variant_equal(a, b);
+}
+
+static GHashTable *batch_changed_new(void)
+{
+	return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static void batch_flush_item(DbusmenuMenuitem *item, BatchItem *batch_item)
+{
+	/* Changes made by the handlers below go to the next window */
+	GHashTable *changed = batch_item->changed;
+	GHashTableIter iter;
+	gpointer name;
+
+	batch_item->changed = batch_changed_new();
+	g_hash_table_iter_init(&iter, changed);
+
+	while (g_hash_table_iter_next(&iter, &name, NULL))
+	{
+		GVariant *value = dbusmenu_menuitem_property_get_variant(item, name);
+
+		if (batch_value_equal(value, g_hash_table_lookup(batch_item->sent, name)))
+			continue;
+
+		if (value != NULL)
+			g_hash_table_insert(batch_item->sent, g_strdup(name), g_variant_ref(value));
+		else
+			g_hash_table_remove(batch_item->sent, name);
+
+		batch_emitting_item  = item;
+		batch_emitting_name  = name;
+		batch_emitting_value = value;
+		g_signal_emit_by_name(item, DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED, name, value);
+		batch_emitting_item  = NULL;
+		batch_emitting_name  = NULL;
+		batch_emitting_value = NULL;
+		batch_properties_forwarded++;
+	}
+
+	g_hash_table_unref(changed);
+}
+
+static gboolean batch_flush(gpointer user_data)
+{
+	GHashTable *pending = batch_pending;
+	GHashTableIter iter;
+	gpointer item;
+
+	batch_source_id = 0;
+	batch_pending   = NULL;
+
+	if (pending == NULL)
+		return G_SOURCE_REMOVE;
+
+	g_hash_table_iter_init(&iter, pending);
+
+	while (g_hash_table_iter_next(&iter, &item, NULL))
+	{
+		BatchItem *batch_item = g_object_get_data(item, BATCH_ITEM);
+
+		if (batch_item != NULL)
+			batch_flush_item(item, batch_item);
+	}
+
+	g_hash_table_unref(pending);
+	batch_flushes++;
+
+	return G_SOURCE_REMOVE;
+}
+
+static void batch_schedule_flush(void)
+{
+	guint window_ms;
+
+	if (batch_source_id != 0)
+		return;
+
+	window_ms = batch_get_window_ms();
+
+	/* The window starts with the first change, so a steady stream of changes
+	 * is still sent every window_ms */
+	if (window_ms > 0)
+		batch_source_id = g_timeout_add(window_ms, batch_flush, NULL);
+	else
+		batch_source_id = g_idle_add_full(G_PRIORITY_HIGH_IDLE, batch_flush, NULL, NULL);
+}
+
+static void on_batch_property_changed(DbusmenuMenuitem *item, const char *name, GVariant *value,
+                                      gpointer user_data)
+{
+	BatchItem *batch_item = user_data;
+
+	if (item == batch_emitting_item && value == batch_emitting_value &&
+	    g_strcmp0(name, batch_emitting_name) == 0)
+		return;
+
+	/* Keeps the server from seeing the change until the batch is flushed */
+	g_signal_stop_emission_by_name(item, DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED);
+
+	g_hash_table_add(batch_item->changed, g_strdup(name));
+	batch_properties_batched++;
+
+	if (batch_pending == NULL)
+		batch_pending = g_hash_table_new_full(NULL, NULL, g_object_unref, NULL);
+
+	if (!g_hash_table_contains(batch_pending, item))
+		g_hash_table_add(batch_pending, g_object_ref(item));
+
+	batch_schedule_flush();
+}
+
+static void batch_item_free(gpointer data)
+{
+	BatchItem *batch_item = data;
+
+	g_hash_table_unref(batch_item->sent);
+	g_hash_table_unref(batch_item->changed);
+	g_slice_free(BatchItem, batch_item);
+}
+
+/* Starts batching the property changes of item, call before exporting it */
+G_GNUC_INTERNAL void batch_track_item(DbusmenuMenuitem *item)
+{
+	BatchItem *batch_item;
+	GList *names;
+
+	if (g_object_get_data(G_OBJECT(item), BATCH_ITEM) != NULL)
+		return;
+
+	batch_item = g_slice_new0(BatchItem);
+	batch_item->sent =
+	    g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+	batch_item->changed = batch_changed_new();
+
+	/* Whatever the item has now is what the consumer gets from GetLayout */
+	names = dbusmenu_menuitem_properties_list(item);
+
+	for (GList *iter = names; iter != NULL; iter = g_list_next(iter))
+		g_hash_table_insert(batch_item->sent,
+		                    g_strdup(iter->data),
+		                    g_variant_ref(
+		                        dbusmenu_menuitem_property_get_variant(item, iter->data)));
+
+	g_list_free(names);
+
+	g_object_set_data_full(G_OBJECT(item), BATCH_ITEM, batch_item, batch_item_free);
+	g_signal_connect(item,
+	                 DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED,
+	                 G_CALLBACK(on_batch_property_changed),
+	                 batch_item);
+}
+
+static void on_server_layout_updated(DbusmenuServer *server, guint revision, gint parent,
+                                     gpointer user_data)
+{
+	batch_layout_emitted++;
+}
+
+static gboolean batch_flush_for_read(gpointer user_data)
+{
+	g_atomic_int_set(&batch_read_flush_queued, 0);
+
+	if (batch_source_id != 0)
+	{
+		g_source_remove(batch_source_id);
+		batch_flush(NULL);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Runs in the GDBus worker thread */
+static GDBusMessage *batch_read_filter(GDBusConnection *connection, GDBusMessage *message,
+                                       gboolean incoming, gpointer user_data)
+{
+	const char *interface = g_dbus_message_get_interface(message);
+	const char *member    = g_dbus_message_get_member(message);
+
+	if (!incoming || g_dbus_message_get_message_type(message) != G_DBUS_MESSAGE_TYPE_METHOD_CALL ||
+	    (interface != NULL && g_strcmp0(interface, DBUSMENU_INTERFACE) != 0))
+		return message;
+
+	if (g_strcmp0(member, "GetLayout") != 0 && g_strcmp0(member, "GetGroupProperties") != 0 &&
+	    g_strcmp0(member, "GetProperty") != 0)
+		return message;
+
+	/* Dispatched before the idle GDBus queues for the method call */
+	if (g_atomic_int_compare_and_exchange(&batch_read_flush_queued, 0, 1))
+		g_idle_add_full(G_PRIORITY_HIGH, batch_flush_for_read, NULL, NULL);
+
+	return message;
+}
+
+static void on_session_bus_ready(GObject *object, GDBusConnection *connection)
+{
+	if (batch_read_filter_id == 0)
+		batch_read_filter_id =
+		    g_dbus_connection_add_filter(connection, batch_read_filter, NULL, NULL);
+}
+
+/* Counts the LayoutUpdated signals server sends and flushes the batch before
+ * the consumer reads the menu */
+G_GNUC_INTERNAL void batch_track_server(DbusmenuServer *server)
+{
+	g_signal_connect(server,
+	                 DBUSMENU_SERVER_SIGNAL_LAYOUT_UPDATED,
+	                 G_CALLBACK(on_server_layout_updated),
+	                 NULL);
+	session_bus_when_ready(NULL, on_session_bus_ready);
+}
+
+/* Counts a menu shell change that is waiting to be reconciled */
+G_GNUC_INTERNAL void batch_note_layout_change(void)
+{
+	batch_layout_batched++;
+}
+
+G_GNUC_INTERNAL void batch_log_statistics(void)
+{
+	g_debug("batching: %u property changes forwarded to the server as %u in %u flushes, "
+	        "%u shell changes sent as %u layout updates",
+	        batch_properties_batched,
+	        batch_properties_forwarded,
+	        batch_flushes,
+	        batch_layout_batched,
+	        batch_layout_emitted);
+}
@@ -0,0 +1,38 @@
+/*
+ * appmenu-gtk-module
+ * Copyright 2012 Canonical Ltd.
+ * Copyright (C) 2015-2017 Konstantin Pugin <ria.freelander@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: Ryan Lortie <desrt@desrt.ca>
+ *          William Hua <william.hua@canonical.com>
+ *          Konstantin Pugin <ria.freelander@gmail.com>
+ *          Lester Carballo Perez <lestcape@gmail.com>
+ */
+
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <libdbusmenu-glib/menuitem.h>
+#include <libdbusmenu-glib/server.h>
+
+G_GNUC_INTERNAL guint batch_get_window_ms(void);
+G_GNUC_INTERNAL void batch_track_item(DbusmenuMenuitem *item);
+G_GNUC_INTERNAL void batch_track_server(DbusmenuServer *server);
+G_GNUC_INTERNAL void batch_note_layout_change(void);
+G_GNUC_INTERNAL void batch_log_statistics(void);
+
+#endif // BATCH_H
@@ -35,5 +35,28 @@
 #define _UNITY_OBJECT_PATH "_UNITY_OBJECT_PATH"
 #define _GTK_MENUBAR_OBJECT_PATH "_GTK_MENUBAR_OBJECT_PATH"
 #define OBJECT_PATH "/org/appmenu/gtk/window"
+#define DBUSMENU_INTERFACE "com.canonical.dbusmenu"
+
+#define MENU_MODE_ENV "APPMENU_GTK_MENU_MODE"
+#define MENU_MODE_LAZY "lazy"
+#define LAZY_EXPIRE_ENV "APPMENU_GTK_LAZY_EXPIRE"
+#define LAZY_EXPIRE_DEFAULT 120
+#define ICON_CACHE_ENV "APPMENU_GTK_ICON_CACHE_KB"
+#define ICON_CACHE_DEFAULT 1024
+#define EXPORT_POLICY_ENV "APPMENU_GTK_EXPORT_POLICY"
+#define EXPORT_POLICY_EAGER "eager"
+#define EXPORT_POLICY_MAP "map"
+#define EXPORT_POLICY_FOCUS "focus"
+#define EXPORT_SLICE_ENV "APPMENU_GTK_EXPORT_SLICE_MS"
+#define EXPORT_SLICE_DEFAULT 4
+#define BATCH_WINDOW_ENV "APPMENU_GTK_BATCH_MS"
+#define BATCH_WINDOW_DEFAULT 0
+#define LAYOUT_CACHE_ENV "APPMENU_GTK_LAYOUT_CACHE"
+#define REGISTRAR_TIMEOUT_ENV "APPMENU_GTK_REGISTRAR_TIMEOUT_MS"
+#define REGISTRAR_TIMEOUT_DEFAULT 2000
+#define REGISTRARS_ENV "APPMENU_GTK_REGISTRARS"
+#define DORMANT_DELAY_ENV "APPMENU_GTK_DORMANT_DELAY_MS"
+#define DORMANT_DELAY_DEFAULT 5000
+#define STATISTICS_ENV "APPMENU_GTK_STATISTICS"
 
 #endif
@@ -28,21 +28,31 @@
 #include <gtk/gtk.h>
 #include <libdbusmenu-glib/server.h>
 
+#include "icons.h"
+
 struct _WindowData
 {
 	uint window_id;
 	GMenu *menu_model;
 	GSList *menus;
-	GSList *dbusmenu_servers;
+	DbusmenuServer *server;
+	DbusmenuMenuitem *menu_root;
 	GMenuModel *old_model;
 	struct org_kde_kwin_appmenu *kde_appmenu;
+	struct wl_surface *kde_appmenu_surface;
+	char *kde_appmenu_service;
+	char *kde_appmenu_path;
+	char *menubar_object_path;
+	gint64 realize_time;
+	gint64 export_start_time;
+	IconDataAccount *icon_data;
+	gulong export_handler_id;
 	GtkWidget *menu;
 };
 
 struct _MenuShellData
 {
 	GtkWindow *window;
-	DbusmenuServer *server;
 };
 
 #endif // DATASTRUCTSPRIVATE_H
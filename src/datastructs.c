@@ -24,16 +24,15 @@
 
 #include "datastructs.h"
 #include "datastructs-private.h"
+#include "batch.h"
+#include "consts.h"
+#include "layoutcache.h"
+#include "menutree.h"
 #include "platform.h"
+#include "support.h"
 
 #include <libdbusmenu-glib/server.h>
 #include <libdbusmenu-glib/menuitem.h>
-#include <libdbusmenu-gtk/parser.h>
-#include "unity-gtk-menu-item-private.h"
-
-/* libdbusmenu-gtk internal but exported functions */
-DbusmenuMenuitem *dbusmenu_gtk_parse_get_item(GtkWidget *widget);
-DbusmenuMenuitem *dbusmenu_gtk_parse_get_cached_item(GtkWidget *widget);
 
 G_GNUC_INTERNAL G_DEFINE_QUARK(appmenu_gtk_wayland_window_data, appmenu_gtk_wayland_window_data);
 G_DEFINE_BOXED_TYPE(WindowData, appmenu_gtk_wayland_window_data, (GBoxedCopyFunc)window_data_copy,
@@ -42,9 +41,15 @@ G_GNUC_INTERNAL G_DEFINE_QUARK(appmenu_gtk_wayland_menu_shell_data, appmenu_gtk_
 G_DEFINE_BOXED_TYPE(MenuShellData, appmenu_gtk_wayland_menu_shell_data, (GBoxedCopyFunc)menu_shell_data_copy,
                     (GBoxedFreeFunc)menu_shell_data_free);
 
+/* Window data is created when the window is realized */
 G_GNUC_INTERNAL WindowData *window_data_new(void)
 {
-	return g_slice_new0(WindowData);
+	WindowData *window_data = g_slice_new0(WindowData);
+
+	window_data->realize_time = g_get_monotonic_time();
+	window_data->icon_data    = icon_data_account_new();
+
+	return window_data;
 }
 
 G_GNUC_INTERNAL void window_data_free(gpointer data)
@@ -66,15 +71,20 @@ G_GNUC_INTERNAL void window_data_free(gpointer data)
 			g_slist_free_full(menus, g_object_unref);
 		}
 
-		if (window_data->dbusmenu_servers != NULL)
-		{
-			GSList *servers = window_data->dbusmenu_servers;
-			window_data->dbusmenu_servers = NULL;
-			g_slist_free_full(servers, g_object_unref);
-		}
+		if (window_data->server != NULL)
+			g_object_unref(window_data->server);
+
+		if (window_data->menu_root != NULL)
+			g_object_unref(window_data->menu_root);
+
+		release_appmenu(window_data);
 
-		if (window_data->kde_appmenu != NULL)
-			release_appmenu(window_data->kde_appmenu);
+		g_debug("window %u exports %" G_GSIZE_FORMAT " bytes of icon-data",
+		        window_data->window_id,
+		        icon_data_account_get_bytes(window_data->icon_data));
+		icon_data_account_unref(window_data->icon_data);
+
+		g_free(window_data->menubar_object_path);
 
 		g_slice_free(WindowData, window_data);
 	}
@@ -84,6 +94,8 @@ G_GNUC_INTERNAL WindowData *window_data_copy(WindowData *source)
 {
 	WindowData *ret = window_data_new();
 
+	ret->realize_time = source->realize_time;
+
 	if (source->menu_model != NULL)
 		ret->menu_model = g_object_ref(source->menu_model);
 
@@ -105,15 +117,7 @@ G_GNUC_INTERNAL void menu_shell_data_free(gpointer data)
 {
 	MenuShellData *menu_shell_data = data;
 	if (menu_shell_data != NULL)
-	{
-		if (menu_shell_data->server != NULL)
-		{
-			DbusmenuServer *server = menu_shell_data->server;
-			menu_shell_data->server = NULL;
-			g_object_unref(server);
-		}
 		g_slice_free(MenuShellData, menu_shell_data);
-	}
 }
 
 G_GNUC_INTERNAL MenuShellData *menu_shell_data_copy(MenuShellData *source)
@@ -232,174 +236,325 @@ G_GNUC_INTERNAL void gtk_window_disconnect_menu_shell(GtkWindow *window, GtkMenu
 			window_data->menus = g_slist_delete_link(window_data->menus, iter);
 		}
 
-		if (menu_shell_data->server != NULL)
-		{
-		    DbusmenuServer *srv = menu_shell_data->server;
-		    GSList *link = g_slist_find(window_data->dbusmenu_servers, srv);
-		    if (link) {
-			window_data->dbusmenu_servers = g_slist_delete_link(window_data->dbusmenu_servers, link);
-			g_object_unref(srv); // unref for list
-		    }
-		    g_object_unref(srv); // unref for MenuShellData
-		    menu_shell_data->server = NULL;
-		}
+		if (window_data->menu_root != NULL)
+			menu_tree_detach_shell(window_data->menu_root, menu_shell);
 
 		menu_shell_data->window = NULL;
 	}
 }
 
-static void fix_dbusmenu_icons(GtkWidget *widget, gpointer user_data);
+static void gtk_window_announce_menubar(GObject *object, GDBusConnection *connection)
+{
+	GtkWindow *window = GTK_WINDOW(object);
+	WindowData *window_data;
+
+	window_data = gtk_window_peek_window_data(window);
+
+	if (window_data == NULL || window_data->menubar_object_path == NULL)
+		return;
+
+	appmenu_set_address(window_data,
+	                    gtk_widget_get_window(GTK_WIDGET(window)),
+	                    g_dbus_connection_get_unique_name(connection),
+	                    window_data->menubar_object_path);
+
+	g_debug("gtk_window_announce_menubar: %s announced %.3f ms after realize, %.3f ms after "
+	        "export started",
+	        window_data->menubar_object_path,
+	        (g_get_monotonic_time() - window_data->realize_time) / 1000.0,
+	        (g_get_monotonic_time() - window_data->export_start_time) / 1000.0);
+}
 
-static void on_menu_show(GtkWidget *widget, gpointer user_data)
+typedef enum
 {
-	g_debug("APPMENU-GTK-WAYLAND: menu show, re-fixing icons for %p", widget);
-	fix_dbusmenu_icons(widget, NULL);
+	EXPORT_POLICY_ON_REALIZE,
+	EXPORT_POLICY_ON_MAP,
+	EXPORT_POLICY_ON_FOCUS,
+} ExportPolicy;
+
+/*
+ * Menus are parsed and put on the bus when the window is realized. Windows
+ * are often realized long before they are shown, or never shown at all, so
+ * EXPORT_POLICY_ENV can defer the export to "map" or to the first activation
+ * with "focus".
+ */
+static ExportPolicy export_policy_get(void)
+{
+	static int policy = -1;
+
+	if (policy < 0)
+	{
+		const char *value = g_getenv(EXPORT_POLICY_ENV);
+
+		if (g_strcmp0(value, EXPORT_POLICY_MAP) == 0)
+			policy = EXPORT_POLICY_ON_MAP;
+		else if (g_strcmp0(value, EXPORT_POLICY_FOCUS) == 0)
+			policy = EXPORT_POLICY_ON_FOCUS;
+		else
+			policy = EXPORT_POLICY_ON_REALIZE;
+	}
+
+	return policy;
 }
 
-static void fix_dbusmenu_icons(GtkWidget *widget, gpointer user_data)
+static guint window_export_complete_signal = 0;
+
+/*
+ * Registers GtkWindow::appmenu-export-complete, which is emitted once every
+ * menu of the window has been exported, so tests and benchmarks can wait for
+ * the idle export to finish.
+ */
+G_GNUC_INTERNAL void window_export_signals_init(void)
+{
+	if (window_export_complete_signal != 0)
+		return;
+
+	window_export_complete_signal = g_signal_lookup("appmenu-export-complete", GTK_TYPE_WINDOW);
+
+	if (window_export_complete_signal == 0)
+		window_export_complete_signal = g_signal_new("appmenu-export-complete",
+		                                             GTK_TYPE_WINDOW,
+		                                             G_SIGNAL_RUN_LAST,
+		                                             0,
+		                                             NULL,
+		                                             NULL,
+		                                             NULL,
+		                                             G_TYPE_NONE,
+		                                             0);
+}
+
+static void on_menu_tree_complete(gpointer user_data)
 {
-	if (GTK_IS_MENU_ITEM(widget))
+	GtkWindow *window       = user_data;
+	WindowData *window_data = gtk_window_peek_window_data(window);
+
+	if (window_data != NULL)
+		g_debug("on_menu_tree_complete: window %u exported in %.3f ms",
+		        window_data->window_id,
+		        (g_get_monotonic_time() - window_data->export_start_time) / 1000.0);
+
+	if (window_export_complete_signal != 0)
+		g_signal_emit(window, window_export_complete_signal, 0);
+}
+
+/* Creates the server of the window and attaches every connected menu shell */
+static void gtk_window_export_menu_shells(GtkWindow *window, WindowData *window_data)
+{
+	if (window_data->server != NULL)
+		return;
+
+	g_debug("gtk_window_export_menu_shells: exporting window %u", window_data->window_id);
+
+	/* All menubars of the window share one server and one root item */
+	window_data->export_start_time   = g_get_monotonic_time();
+	window_data->menubar_object_path = g_strdup_printf("/MenuBar/%d", window_data->window_id);
+	window_data->menu_root           = menu_tree_new(on_menu_tree_complete, window);
+	window_data->server              = dbusmenu_server_new(window_data->menubar_object_path);
+	batch_track_server(window_data->server);
+	layout_cache_track_server(window_data->server, window_data->menubar_object_path);
+	dbusmenu_server_set_root(window_data->server, window_data->menu_root);
+
+	for (GSList *iter = window_data->menus; iter != NULL; iter = g_slist_next(iter))
+		menu_tree_attach_shell(window_data->menu_root, iter->data);
+
+	session_bus_when_ready(G_OBJECT(window), gtk_window_announce_menubar);
+}
+
+static void on_window_map(GtkWidget *widget, gpointer user_data);
+static void on_window_is_active_notify(GObject *object, GParamSpec *pspec, gpointer user_data);
+
+static void gtk_window_export_now(GtkWindow *window)
+{
+	WindowData *window_data = gtk_window_peek_window_data(window);
+
+	/* Also drops handlers left over from window data freed on unrealize */
+	g_signal_handlers_disconnect_by_func(window, on_window_map, NULL);
+	g_signal_handlers_disconnect_by_func(window, on_window_is_active_notify, NULL);
+
+	if (window_data != NULL)
 	{
-		DbusmenuMenuitem *item = g_object_get_data(G_OBJECT(widget), "dbusmenu-gtk-item");
+		window_data->export_handler_id = 0;
+		gtk_window_export_menu_shells(window, window_data);
+	}
+}
 
-		/* Fallback to internal lookup functions if data is not found directly */
-		if (item == NULL)
-			item = dbusmenu_gtk_parse_get_cached_item(widget);
-		if (item == NULL)
-			item = dbusmenu_gtk_parse_get_item(widget);
+static void on_window_map(GtkWidget *widget, gpointer user_data)
+{
+	gtk_window_export_now(GTK_WINDOW(widget));
+}
 
-		if (item != NULL)
-		{
-			const gchar *existing_name = dbusmenu_menuitem_property_get(item, "icon-name");
-			GVariant *existing_data = dbusmenu_menuitem_property_get_variant(item, "icon-data");
+static void on_window_is_active_notify(GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+	if (gtk_window_is_active(GTK_WINDOW(object)))
+		gtk_window_export_now(GTK_WINDOW(object));
+}
 
-			/* Only set the icon if it's not already set or is empty */
-			if ((existing_name == NULL || existing_name[0] == '\0') &&
-			    existing_data == NULL)
-			{
-				/* gtk_menu_item_get_icon returns a new reference (strongly reffed)
-				 * to ensure the icon remains valid during processing.
-				 */
-				GIcon *icon = gtk_menu_item_get_icon(GTK_MENU_ITEM(widget));
-				if (icon != NULL)
-				{
-					if (G_IS_THEMED_ICON(icon))
-					{
-						const gchar *const *names =
-						    g_themed_icon_get_names(G_THEMED_ICON(icon));
-						if (names != NULL && names[0] != NULL)
-						{
-							g_debug("APPMENU-GTK-WAYLAND: fixing icon-name: %s for %p",
-							        names[0], widget);
-							dbusmenu_menuitem_property_set(item,
-							                               "icon-name",
-							                               names[0]);
-							dbusmenu_menuitem_property_set_bool(item, "icon-visible", TRUE);
-						}
-					}
-					else
-					{
-						GdkPixbuf *pixbuf = NULL;
-						gboolean new_pixbuf = FALSE;
-
-						if (GDK_IS_PIXBUF(icon)) {
-							pixbuf = GDK_PIXBUF(icon);
-						} else {
-							GError *error = NULL;
-							gint width = 16, height = 16;
-							gtk_icon_size_lookup(GTK_ICON_SIZE_MENU, &width, &height);
-							GdkScreen *screen = gtk_widget_get_screen(widget);
-							GtkIconTheme *icon_theme = screen ? gtk_icon_theme_get_for_screen(screen) : gtk_icon_theme_get_default();
-							G_GNUC_BEGIN_IGNORE_DEPRECATIONS
-							GtkIconInfo *icon_info = gtk_icon_theme_lookup_by_gicon(icon_theme, icon, width, GTK_ICON_LOOKUP_FORCE_SIZE);
-							if (icon_info) {
-								pixbuf = gtk_icon_info_load_icon(icon_info, &error);
-								g_object_unref(icon_info);
-							}
-							G_GNUC_END_IGNORE_DEPRECATIONS
-
-							if (error) {
-								g_debug("APPMENU-GTK-WAYLAND: failed to load icon: %s", error->message);
-								g_error_free(error);
-							}
-							new_pixbuf = (pixbuf != NULL);
-						}
-
-						if (pixbuf)
-						{
-							g_debug("APPMENU-GTK-WAYLAND: fixing icon-data for %p (new_pixbuf: %d)", widget, new_pixbuf);
-							GVariant *pixels = g_variant_new_from_data(
-							    G_VARIANT_TYPE("ay"),
-							    gdk_pixbuf_get_pixels(pixbuf),
-							    (gsize)gdk_pixbuf_get_height(pixbuf) * gdk_pixbuf_get_rowstride(pixbuf),
-							    TRUE,
-							    (GDestroyNotify)g_object_unref,
-							    g_object_ref(pixbuf));
-							GVariant *variant = g_variant_new(
-							    "(iiib@ay)",
-							    gdk_pixbuf_get_width(pixbuf),
-							    gdk_pixbuf_get_height(pixbuf),
-							    gdk_pixbuf_get_rowstride(pixbuf),
-							    gdk_pixbuf_get_has_alpha(pixbuf),
-							    pixels);
-
-							dbusmenu_menuitem_property_set_variant(
-							    item,
-							    "icon-data",
-							    variant);
-							dbusmenu_menuitem_property_set_bool(item, "icon-visible", TRUE);
-							if (new_pixbuf) {
-								g_object_unref(pixbuf);
-							}
-						}
-					}
-					g_object_unref(icon);
-				}
-			}
+static void gtk_window_schedule_export(GtkWindow *window, WindowData *window_data)
+{
+	if (window_data->export_handler_id != 0)
+		return;
+
+	switch (export_policy_get())
+	{
+	case EXPORT_POLICY_ON_MAP:
+		if (!gtk_widget_get_mapped(GTK_WIDGET(window)))
+		{
+			window_data->export_handler_id =
+			    g_signal_connect(window, "map", G_CALLBACK(on_window_map), NULL);
+			return;
 		}
+		break;
 
-		GtkWidget *submenu = gtk_menu_item_get_submenu(GTK_MENU_ITEM(widget));
-		if (submenu != NULL)
+	case EXPORT_POLICY_ON_FOCUS:
+		if (!gtk_window_is_active(window))
 		{
-			if (g_signal_handler_find(submenu, G_SIGNAL_MATCH_FUNC, 0, 0, NULL, on_menu_show,
-			                          NULL) == 0)
-			{
-				g_signal_connect(submenu, "show", G_CALLBACK(on_menu_show), NULL);
-			}
-			fix_dbusmenu_icons(submenu, NULL);
+			window_data->export_handler_id = g_signal_connect(window,
+			                                                  "notify::is-active",
+			                                                  G_CALLBACK(
+			                                                      on_window_is_active_notify),
+			                                                  NULL);
+			return;
 		}
+		break;
+
+	case EXPORT_POLICY_ON_REALIZE:
+		break;
 	}
 
-	if (GTK_IS_CONTAINER(widget))
+	gtk_window_export_menu_shells(window, window_data);
+}
+
+/* Drops the server and tree of the window, keeping only its list of menu shells */
+static void gtk_window_unexport_menu_shells(GtkWindow *window, WindowData *window_data)
+{
+	if (window_data->export_handler_id != 0)
 	{
-		gtk_container_forall(GTK_CONTAINER(widget), (GtkCallback)fix_dbusmenu_icons, NULL);
+		g_signal_handler_disconnect(window, window_data->export_handler_id);
+		window_data->export_handler_id = 0;
 	}
+
+	if (window_data->server == NULL)
+		return;
+
+	g_debug("gtk_window_unexport_menu_shells: window %u goes dormant", window_data->window_id);
+
+	for (GSList *iter = window_data->menus; iter != NULL; iter = g_slist_next(iter))
+		menu_tree_detach_shell(window_data->menu_root, iter->data);
+
+	release_appmenu(window_data);
+	g_clear_object(&window_data->server);
+	g_clear_object(&window_data->menu_root);
+	g_clear_pointer(&window_data->menubar_object_path, g_free);
+}
+
+/* Windows that had a menu shell connected, exported or dormant */
+static GHashTable *menu_windows = NULL;
+static guint dormant_source_id  = 0;
+
+static void on_menu_window_finalized(gpointer data, GObject *window)
+{
+	g_hash_table_remove(menu_windows, window);
 }
 
-typedef struct
+static void gtk_window_track_menus(GtkWindow *window)
 {
-	GtkWidget *widget;
-} FixIconsData;
+	if (menu_windows == NULL)
+		menu_windows = g_hash_table_new(NULL, NULL);
 
-static gboolean fix_icons_idle(gpointer data)
+	if (g_hash_table_add(menu_windows, window))
+		g_object_weak_ref(G_OBJECT(window), on_menu_window_finalized, NULL);
+}
+
+static gboolean gtk_windows_go_dormant(gpointer user_data)
 {
-	FixIconsData *fid = data;
-	if (fid->widget != NULL)
+	GHashTableIter iter;
+	gpointer window;
+
+	dormant_source_id = 0;
+	g_hash_table_iter_init(&iter, menu_windows);
+
+	while (g_hash_table_iter_next(&iter, &window, NULL))
 	{
-		GtkWidget *widget = fid->widget;
-		g_object_remove_weak_pointer(G_OBJECT(widget), (gpointer *)&fid->widget);
-		fix_dbusmenu_icons(widget, NULL);
+		WindowData *window_data = gtk_window_peek_window_data(window);
+
+		if (window_data != NULL)
+			gtk_window_unexport_menu_shells(window, window_data);
 	}
-	g_free(fid);
+
 	return G_SOURCE_REMOVE;
 }
 
-static void schedule_fix_icons(GtkWidget *widget)
+/*
+ * Called when a consumer of exported menus (a registrar or the appmenu global
+ * of the compositor) appears or vanishes. Without one, menu shells are only
+ * recorded: nothing is parsed or put on the bus. The first consumer exports
+ * every recorded window in one pass; once the last one is gone for
+ * DORMANT_DELAY_ENV milliseconds the exports are dropped again, so a
+ * restarting panel does not cost a full re-export.
+ */
+G_GNUC_INTERNAL void gtk_windows_consumer_changed(bool present)
 {
-	FixIconsData *fid = g_new0(FixIconsData, 1);
-	fid->widget       = widget;
-	g_object_add_weak_pointer(G_OBJECT(widget), (gpointer *)&fid->widget);
-	g_idle_add(fix_icons_idle, fid);
+	GHashTableIter iter;
+	gpointer window;
+
+	if (menu_windows == NULL)
+		return;
+
+	if (!present)
+	{
+		if (dormant_source_id == 0)
+			dormant_source_id =
+			    g_timeout_add(module_env_get_uint(DORMANT_DELAY_ENV, DORMANT_DELAY_DEFAULT),
+			                  gtk_windows_go_dormant,
+			                  NULL);
+		return;
+	}
+
+	if (dormant_source_id != 0)
+	{
+		g_source_remove(dormant_source_id);
+		dormant_source_id = 0;
+	}
+
+	g_hash_table_iter_init(&iter, menu_windows);
+
+	while (g_hash_table_iter_next(&iter, &window, NULL))
+	{
+		WindowData *window_data = gtk_window_peek_window_data(window);
+
+		if (window_data != NULL && window_data->menus != NULL && window_data->server == NULL)
+			gtk_window_schedule_export(window, window_data);
+	}
+}
+
+/*
+ * Called when the appmenu manager of the compositor is withdrawn or bound
+ * again. The appmenu objects of all windows are released together, and a new
+ * manager gets the addresses of every exported window in one pass; the
+ * requests share a single flush and no menu is parsed again.
+ */
+G_GNUC_INTERNAL void gtk_windows_appmenu_manager_changed(bool present)
+{
+	GHashTableIter iter;
+	gpointer window;
+
+	if (menu_windows == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, menu_windows);
+
+	while (g_hash_table_iter_next(&iter, &window, NULL))
+	{
+		WindowData *window_data = gtk_window_peek_window_data(window);
+
+		if (window_data == NULL)
+			continue;
+
+		if (!present)
+			release_appmenu(window_data);
+		else if (window_data->menubar_object_path != NULL)
+			session_bus_when_ready(G_OBJECT(window), gtk_window_announce_menubar);
+	}
 }
 
 G_GNUC_INTERNAL void gtk_window_connect_menu_shell(GtkWindow *window, GtkMenuShell *menu_shell)
@@ -440,44 +595,15 @@ G_GNUC_INTERNAL void gtk_window_connect_menu_shell(GtkWindow *window, GtkMenuShe
 				g_debug("gtk_window_connect_menu_shell: connecting new menu shell");
 				window_data->menus = g_slist_append(window_data->menus, g_object_ref(menu_shell));
 
-				DbusmenuMenuitem *item = dbusmenu_gtk_parse_menu_structure(GTK_WIDGET(menu_shell));
-				if (item == NULL)
-				{
-					g_debug("gtk_window_connect_menu_shell: failed to parse menu structure");
-				}
+				if (window_data->server != NULL)
+					menu_tree_attach_shell(window_data->menu_root, menu_shell);
+				else if (appmenu_consumer_present())
+					gtk_window_schedule_export(window, window_data);
 				else
-				{
-					fix_dbusmenu_icons(GTK_WIDGET(menu_shell), NULL);
-					schedule_fix_icons(GTK_WIDGET(menu_shell));
-				}
-
-				gchar *path = g_strdup_printf("/MenuBar/%d/%p", window_data->window_id, menu_shell);
-				DbusmenuServer *srv = dbusmenu_server_new(path);
-				dbusmenu_server_set_root(srv, item);
-				if (item != NULL)
-					g_object_unref(item);
-
-				window_data->dbusmenu_servers = g_slist_append(window_data->dbusmenu_servers, srv);
-				menu_shell_data->server       = g_object_ref(srv);
-
-				GDBusConnection* connection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
-				if (connection != NULL)
-				{
-					const char* unique_bus_name = g_dbus_connection_get_unique_name(connection);
-
-					if (window_data->kde_appmenu != NULL)
-						release_appmenu(window_data->kde_appmenu);
-
-					window_data->kde_appmenu = appmenu_set_address(gtk_widget_get_window(GTK_WIDGET(window)), unique_bus_name, path);
-					g_object_unref(connection);
-				}
-				else
-				{
-					g_debug("gtk_window_connect_menu_shell: failed to get session bus");
-				}
-
-				g_free(path);
+					g_debug("gtk_window_connect_menu_shell: no consumer, staying dormant");
 			}
+
+			gtk_window_track_menus(window);
 		}
 
 		menu_shell_data->window = window;
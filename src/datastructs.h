@@ -48,7 +48,10 @@ G_GNUC_INTERNAL GtkWindow *menu_shell_data_get_window(MenuShellData *source);
 G_GNUC_INTERNAL void menu_shell_data_free(gpointer data);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(MenuShellData, menu_shell_data_free);
 
+G_GNUC_INTERNAL void window_export_signals_init(void);
 G_GNUC_INTERNAL void gtk_window_connect_menu_shell(GtkWindow *window, GtkMenuShell *menu_shell);
 G_GNUC_INTERNAL void gtk_window_disconnect_menu_shell(GtkWindow *window, GtkMenuShell *menu_shell);
+G_GNUC_INTERNAL void gtk_windows_consumer_changed(bool present);
+G_GNUC_INTERNAL void gtk_windows_appmenu_manager_changed(bool present);
 
 #endif // DATASTRUCTS_H
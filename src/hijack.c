@@ -64,6 +64,8 @@ static void (*pre_hijacked_menu_bar_get_preferred_width_for_height)(GtkWidget *w
 static void (*pre_hijacked_menu_bar_get_preferred_height_for_width)(GtkWidget *widget, gint width,
                                                                     gint *minimum_height,
                                                                     gint *natural_height);
+
+static gboolean (*pre_hijacked_menu_bar_draw)(GtkWidget *widget, cairo_t *cr);
 #endif
 
 static void hijacked_window_realize(GtkWidget *widget)
@@ -165,6 +167,9 @@ static void hijacked_menu_bar_size_allocate(GtkWidget *widget, GtkAllocation *al
 		/*
 		 * We manually assign an empty allocation to the menu bar to
 		 * prevent the container from attempting to draw it at all.
+		 * Only the GtkWidget implementation runs, so the items are
+		 * neither measured nor allocated; the original allocation runs
+		 * again once the menubar is shown and resized.
 		 */
 		if (pre_hijacked_widget_size_allocate != NULL)
 			pre_hijacked_widget_size_allocate(widget, &zero);
@@ -188,14 +193,13 @@ static void hijacked_menu_bar_size_request(GtkWidget *widget, GtkRequisition *re
 {
 	g_return_if_fail(GTK_IS_MENU_BAR(widget));
 
-	if (pre_hijacked_menu_bar_size_request != NULL)
-		pre_hijacked_menu_bar_size_request(widget, requisition);
-
 	if (gtk_widget_shell_shows_menubar(widget))
 	{
 		requisition->width  = 0;
 		requisition->height = 0;
 	}
+	else if (pre_hijacked_menu_bar_size_request != NULL)
+		pre_hijacked_menu_bar_size_request(widget, requisition);
 }
 #elif GTK_MAJOR_VERSION == 3
 static void hijacked_menu_bar_get_preferred_width(GtkWidget *widget, gint *minimum_width,
@@ -203,14 +207,13 @@ static void hijacked_menu_bar_get_preferred_width(GtkWidget *widget, gint *minim
 {
 	g_return_if_fail(GTK_IS_MENU_BAR(widget));
 
-	if (pre_hijacked_menu_bar_get_preferred_width != NULL)
-		pre_hijacked_menu_bar_get_preferred_width(widget, minimum_width, natural_width);
-
 	if (gtk_widget_shell_shows_menubar(widget))
 	{
 		*minimum_width = 0;
 		*natural_width = 0;
 	}
+	else if (pre_hijacked_menu_bar_get_preferred_width != NULL)
+		pre_hijacked_menu_bar_get_preferred_width(widget, minimum_width, natural_width);
 }
 
 static void hijacked_menu_bar_get_preferred_height(GtkWidget *widget, gint *minimum_height,
@@ -218,14 +221,13 @@ static void hijacked_menu_bar_get_preferred_height(GtkWidget *widget, gint *mini
 {
 	g_return_if_fail(GTK_IS_MENU_BAR(widget));
 
-	if (pre_hijacked_menu_bar_get_preferred_height != NULL)
-		pre_hijacked_menu_bar_get_preferred_height(widget, minimum_height, natural_height);
-
 	if (gtk_widget_shell_shows_menubar(widget))
 	{
 		*minimum_height = 0;
 		*natural_height = 0;
 	}
+	else if (pre_hijacked_menu_bar_get_preferred_height != NULL)
+		pre_hijacked_menu_bar_get_preferred_height(widget, minimum_height, natural_height);
 }
 
 static void hijacked_menu_bar_get_preferred_width_for_height(GtkWidget *widget, gint height,
@@ -234,17 +236,16 @@ static void hijacked_menu_bar_get_preferred_width_for_height(GtkWidget *widget,
 {
 	g_return_if_fail(GTK_IS_MENU_BAR(widget));
 
-	if (pre_hijacked_menu_bar_get_preferred_width_for_height != NULL)
-		pre_hijacked_menu_bar_get_preferred_width_for_height(widget,
-		                                                     height,
-		                                                     minimum_width,
-		                                                     natural_width);
-
 	if (gtk_widget_shell_shows_menubar(widget))
 	{
 		*minimum_width = 0;
 		*natural_width = 0;
 	}
+	else if (pre_hijacked_menu_bar_get_preferred_width_for_height != NULL)
+		pre_hijacked_menu_bar_get_preferred_width_for_height(widget,
+		                                                     height,
+		                                                     minimum_width,
+		                                                     natural_width);
 }
 
 static void hijacked_menu_bar_get_preferred_height_for_width(GtkWidget *widget, gint width,
@@ -253,17 +254,30 @@ static void hijacked_menu_bar_get_preferred_height_for_width(GtkWidget *widget,
 {
 	g_return_if_fail(GTK_IS_MENU_BAR(widget));
 
-	if (pre_hijacked_menu_bar_get_preferred_height_for_width != NULL)
+	if (gtk_widget_shell_shows_menubar(widget))
+	{
+		*minimum_height = 0;
+		*natural_height = 0;
+	}
+	else if (pre_hijacked_menu_bar_get_preferred_height_for_width != NULL)
 		pre_hijacked_menu_bar_get_preferred_height_for_width(widget,
 		                                                     width,
 		                                                     minimum_height,
 		                                                     natural_height);
+}
 
+static gboolean hijacked_menu_bar_draw(GtkWidget *widget, cairo_t *cr)
+{
+	g_return_val_if_fail(GTK_IS_MENU_BAR(widget), FALSE);
+
+	/* The items of a hidden menubar were never allocated, do not draw them */
 	if (gtk_widget_shell_shows_menubar(widget))
-	{
-		*minimum_height = 0;
-		*natural_height = 0;
-	}
+		return FALSE;
+
+	if (pre_hijacked_menu_bar_draw != NULL)
+		return pre_hijacked_menu_bar_draw(widget, cr);
+
+	return FALSE;
 }
 #endif
 
@@ -326,6 +340,7 @@ G_GNUC_INTERNAL void store_pre_hijacked()
 	    widget_class->get_preferred_width_for_height;
 	pre_hijacked_menu_bar_get_preferred_height_for_width =
 	    widget_class->get_preferred_height_for_width;
+	pre_hijacked_menu_bar_draw = widget_class->draw;
 #endif
 }
 G_GNUC_INTERNAL void hijack_menu_bar_class_vtable(GType type)
@@ -366,6 +381,9 @@ G_GNUC_INTERNAL void hijack_menu_bar_class_vtable(GType type)
 	    pre_hijacked_menu_bar_get_preferred_height_for_width)
 		widget_class->get_preferred_height_for_width =
 		    hijacked_menu_bar_get_preferred_height_for_width;
+
+	if (widget_class->draw == pre_hijacked_menu_bar_draw)
+		widget_class->draw = hijacked_menu_bar_draw;
 #endif
 
 	children = g_type_children(type, &n);
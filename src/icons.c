@@ -0,0 +1,969 @@
+/*
+ * appmenu-gtk-module
+ * Copyright 2012 Canonical Ltd.
+ * Copyright (C) 2015-2017 Konstantin Pugin <ria.freelander@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: Ryan Lortie <desrt@desrt.ca>
+ *          William Hua <william.hua@canonical.com>
+ *          Konstantin Pugin <ria.freelander@gmail.com>
+ *          Lester Carballo Perez <lestcape@gmail.com>
+ */
+
+#include "icons.h"
+#include "consts.h"
+#include "datastructs.h"
+#include "datastructs-private.h"
+#include "menutree.h"
+#include "support.h"
+
+#include <libdbusmenu-glib/menuitem.h>
+#include <stdbool.h>
+#include <string.h>
+#include "unity-gtk-menu-item-private.h"
+
+typedef struct
+{
+	GIcon *icon;
+	gint size;
+	gint scale;
+} IconKey;
+
+typedef struct
+{
+	IconKey key;
+	GVariant *data;
+	gsize bytes;
+	GList link;
+} IconCacheEntry;
+
+typedef struct
+{
+	DbusmenuMenuitem *item;
+	GtkWidget *widget;
+	GCancellable *cancellable;
+	IconKey key;
+} IconLoad;
+
+typedef struct
+{
+	char *digest;
+	gchar *buffer;
+	gsize size;
+	/* GBytes wrapping buffer that are still alive, see icon_payload_release() */
+	guint users;
+} IconPayload;
+
+/*
+ * Serialized icon-data shared by every item and window of the process. The
+ * entries are kept in least recently used order and evicted once their PNG
+ * data exceeds ICON_CACHE_ENV kilobytes.
+ */
+static GHashTable *icon_cache     = NULL;
+static GQueue icon_cache_lru      = G_QUEUE_INIT;
+static gsize icon_cache_bytes     = 0;
+static guint icon_cache_hits      = 0;
+static guint icon_cache_misses    = 0;
+static guint icon_cache_evictions = 0;
+
+/* Pixel bytes encoded so far and the PNG bytes they were encoded to */
+static gsize icon_raw_bytes = 0;
+static gsize icon_png_bytes = 0;
+
+#define ICON_DATA_USE "appmenu-gtk-icon-data-use"
+
+/*
+ * icon-data bytes currently set on the exported items of one window, icons
+ * sent by name or path add none. Items keep the account alive, so one that
+ * outlives its window still finds it when its icon-data goes away.
+ */
+struct _IconDataAccount
+{
+	guint ref_count;
+	gsize bytes;
+};
+
+/* Attached to an item for the icon-data it holds */
+typedef struct
+{
+	IconDataAccount *account;
+	gsize size;
+} IconDataUse;
+
+/*
+ * icon-data in use, by SHA-256 of the pixels it encodes. Pixbufs loaded
+ * separately for different GIcons, e.g. the same check mark or document icon
+ * in many places, share one PNG payload instead of each holding a copy.
+ */
+static GHashTable *icon_payloads      = NULL;
+static GMutex icon_payloads_lock;
+static guint icon_payload_hits        = 0;
+static gsize icon_payload_saved_bytes = 0;
+
+/* Menu items whose icon has to be (re)considered, see mark_dbusmenu_icons() */
+static GHashTable *icon_dirty_items = NULL;
+static guint icon_flush_source_id   = 0;
+
+G_GNUC_INTERNAL G_DEFINE_QUARK(appmenu_gtk_wayland_icon_load, appmenu_gtk_wayland_icon_load);
+G_GNUC_INTERNAL G_DEFINE_QUARK(appmenu_gtk_wayland_icon_image, appmenu_gtk_wayland_icon_image);
+G_GNUC_INTERNAL G_DEFINE_QUARK(appmenu_gtk_wayland_icon_tracked, appmenu_gtk_wayland_icon_tracked);
+
+/* Properties of the GtkImage of a menu item that change the icon it shows */
+static const char *const ICON_IMAGE_PROPERTIES[] = { "notify::gicon",
+                                                     "notify::icon-name",
+                                                     "notify::pixbuf",
+                                                     "notify::file" };
+
+static void mark_dbusmenu_icons(GtkWidget *widget, gpointer user_data);
+
+static guint icon_key_hash(gconstpointer data)
+{
+	const IconKey *key = data;
+
+	return g_icon_hash(key->icon) ^ ((guint)key->size << 8) ^ (guint)key->scale;
+}
+
+static gboolean icon_key_equal(gconstpointer a, gconstpointer b)
+{
+	const IconKey *key_a = a;
+	const IconKey *key_b = b;
+
+	return key_a->size == key_b->size && key_a->scale == key_b->scale &&
+	       g_icon_equal(key_a->icon, key_b->icon);
+}
+
+static void icon_cache_entry_free(gpointer data)
+{
+	IconCacheEntry *entry = data;
+
+	g_object_unref(entry->key.icon);
+	g_variant_unref(entry->data);
+	g_slice_free(IconCacheEntry, entry);
+}
+
+static GVariant *icon_cache_lookup(IconKey *key)
+{
+	IconCacheEntry *entry = NULL;
+
+	if (icon_cache != NULL)
+		entry = g_hash_table_lookup(icon_cache, key);
+
+	if (entry == NULL)
+	{
+		icon_cache_misses++;
+		return NULL;
+	}
+
+	icon_cache_hits++;
+	g_queue_unlink(&icon_cache_lru, &entry->link);
+	g_queue_push_head_link(&icon_cache_lru, &entry->link);
+
+	return entry->data;
+}
+
+static void icon_cache_insert(IconKey *key, GVariant *data, gsize bytes)
+{
+	gsize limit = (gsize)module_env_get_uint(ICON_CACHE_ENV, ICON_CACHE_DEFAULT) * 1024;
+	IconCacheEntry *entry;
+
+	if (bytes > limit)
+		return;
+
+	if (icon_cache == NULL)
+		icon_cache =
+		    g_hash_table_new_full(icon_key_hash, icon_key_equal, NULL, icon_cache_entry_free);
+
+	entry = g_hash_table_lookup(icon_cache, key);
+
+	if (entry != NULL)
+		return;
+
+	entry            = g_slice_new0(IconCacheEntry);
+	entry->key.icon  = g_object_ref(key->icon);
+	entry->key.size  = key->size;
+	entry->key.scale = key->scale;
+	entry->data      = g_variant_ref(data);
+	entry->bytes     = bytes;
+	entry->link.data = entry;
+
+	g_hash_table_insert(icon_cache, &entry->key, entry);
+	g_queue_push_head_link(&icon_cache_lru, &entry->link);
+	icon_cache_bytes += bytes;
+
+	while (icon_cache_bytes > limit)
+	{
+		IconCacheEntry *last = g_queue_pop_tail_link(&icon_cache_lru)->data;
+
+		icon_cache_bytes -= last->bytes;
+		icon_cache_evictions++;
+		g_hash_table_remove(icon_cache, &last->key);
+	}
+}
+
+G_GNUC_INTERNAL void icons_log_statistics(void)
+{
+	guint n_payloads;
+
+	g_debug("icon cache: %u hits, %u misses, %u evictions, %u entries using %" G_GSIZE_FORMAT
+	        " bytes",
+	        icon_cache_hits,
+	        icon_cache_misses,
+	        icon_cache_evictions,
+	        icon_cache_lru.length,
+	        icon_cache_bytes);
+	g_debug("icon-data: %" G_GSIZE_FORMAT " bytes of pixels encoded as %" G_GSIZE_FORMAT
+	        " bytes of PNG",
+	        icon_raw_bytes,
+	        icon_png_bytes);
+	g_mutex_lock(&icon_payloads_lock);
+	n_payloads = icon_payloads != NULL ? g_hash_table_size(icon_payloads) : 0;
+	g_mutex_unlock(&icon_payloads_lock);
+
+	g_debug("icon-data: %u payloads in use, %u duplicates shared, saving %" G_GSIZE_FORMAT
+	        " bytes",
+	        n_payloads,
+	        icon_payload_hits,
+	        icon_payload_saved_bytes);
+}
+
+static void icon_key_init(IconKey *key, GtkWidget *widget, GIcon *icon)
+{
+	gint width = 16, height = 16;
+
+	gtk_icon_size_lookup(GTK_ICON_SIZE_MENU, &width, &height);
+
+	key->icon  = icon;
+	key->size  = width;
+	key->scale = gtk_widget_get_scale_factor(widget);
+}
+
+/* Hashes the visible pixels of pixbuf, leaving out the row padding */
+static char *icon_pixbuf_digest(GdkPixbuf *pixbuf)
+{
+	GChecksum *checksum  = g_checksum_new(G_CHECKSUM_SHA256);
+	gint width           = gdk_pixbuf_get_width(pixbuf);
+	gint height          = gdk_pixbuf_get_height(pixbuf);
+	gint rowstride       = gdk_pixbuf_get_rowstride(pixbuf);
+	gint n_channels      = gdk_pixbuf_get_n_channels(pixbuf);
+	gint bits            = gdk_pixbuf_get_bits_per_sample(pixbuf);
+	gsize row_length     = ((gsize)width * n_channels * bits + 7) / 8;
+	const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+	char *header;
+	char *digest;
+
+	header = g_strdup_printf("%dx%d:%d:%d:%d;",
+	                         width,
+	                         height,
+	                         n_channels,
+	                         bits,
+	                         gdk_pixbuf_get_has_alpha(pixbuf));
+	g_checksum_update(checksum, (const guchar *)header, -1);
+
+	for (gint row = 0; row < height; row++)
+		g_checksum_update(checksum, pixels + (gsize)row * rowstride, row_length);
+
+	digest = g_strdup(g_checksum_get_string(checksum));
+
+	g_checksum_free(checksum);
+	g_free(header);
+
+	return digest;
+}
+
+/*
+ * The free func of every GBytes wrapping a payload. GDBus drops the last
+ * reference to a reply's icon-data on its worker thread, so this can run off
+ * the main thread: the table is only touched under icon_payloads_lock, and a
+ * payload is counted by users rather than through the refcount of a shared
+ * variant, which a lookup could otherwise revive after it dropped to zero.
+ */
+static void icon_payload_release(gpointer data)
+{
+	IconPayload *payload = data;
+	bool unused;
+
+	g_mutex_lock(&icon_payloads_lock);
+
+	unused = --payload->users == 0;
+
+	if (unused)
+		g_hash_table_remove(icon_payloads, payload->digest);
+
+	g_mutex_unlock(&icon_payloads_lock);
+
+	if (unused)
+	{
+		g_free(payload->digest);
+		g_free(payload->buffer);
+		g_slice_free(IconPayload, payload);
+	}
+}
+
+/* Returns a new icon-data variant using the PNG of payload without copying it */
+static GVariant *icon_payload_wrap(IconPayload *payload)
+{
+	GBytes *bytes = g_bytes_new_with_free_func(payload->buffer,
+	                                           payload->size,
+	                                           icon_payload_release,
+	                                           payload);
+	GVariant *data =
+	    g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE_BYTESTRING, bytes, TRUE));
+
+	g_bytes_unref(bytes);
+
+	return data;
+}
+
+/*
+ * Returns a new reference to the icon-data of pixbuf: a PNG byte array as the
+ * dbusmenu specification asks for. The PNG is encoded once and wrapped without
+ * copying, and every item showing the same pixels wraps the same buffer, so
+ * each is only encoded and kept in memory once.
+ */
+static GVariant *icon_data_new(GdkPixbuf *pixbuf)
+{
+	char *digest  = icon_pixbuf_digest(pixbuf);
+	GError *error = NULL;
+	gchar *buffer = NULL;
+	gsize size    = 0;
+	IconPayload *payload;
+
+	g_mutex_lock(&icon_payloads_lock);
+
+	payload = icon_payloads != NULL ? g_hash_table_lookup(icon_payloads, digest) : NULL;
+
+	if (payload != NULL)
+		payload->users++;
+
+	g_mutex_unlock(&icon_payloads_lock);
+
+	if (payload != NULL)
+	{
+		icon_payload_hits++;
+		icon_payload_saved_bytes += payload->size;
+		g_free(digest);
+
+		return icon_payload_wrap(payload);
+	}
+
+	if (!gdk_pixbuf_save_to_buffer(pixbuf, &buffer, &size, "png", &error, NULL))
+	{
+		g_debug("APPMENU-GTK-WAYLAND: failed to encode icon: %s", error->message);
+		g_error_free(error);
+		g_free(digest);
+		return NULL;
+	}
+
+	payload         = g_slice_new0(IconPayload);
+	payload->digest = digest;
+	payload->buffer = buffer;
+	payload->size   = size;
+	payload->users  = 1;
+
+	g_mutex_lock(&icon_payloads_lock);
+
+	if (icon_payloads == NULL)
+		icon_payloads = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_hash_table_insert(icon_payloads, payload->digest, payload);
+
+	g_mutex_unlock(&icon_payloads_lock);
+
+	icon_raw_bytes += (gsize)gdk_pixbuf_get_height(pixbuf) * gdk_pixbuf_get_rowstride(pixbuf);
+	icon_png_bytes += size;
+
+	return icon_payload_wrap(payload);
+}
+
+G_GNUC_INTERNAL IconDataAccount *icon_data_account_new(void)
+{
+	IconDataAccount *account = g_slice_new0(IconDataAccount);
+
+	account->ref_count = 1;
+
+	return account;
+}
+
+G_GNUC_INTERNAL void icon_data_account_unref(IconDataAccount *account)
+{
+	if (--account->ref_count == 0)
+		g_slice_free(IconDataAccount, account);
+}
+
+G_GNUC_INTERNAL gsize icon_data_account_get_bytes(IconDataAccount *account)
+{
+	return account->bytes;
+}
+
+static void icon_data_use_free(gpointer data)
+{
+	IconDataUse *use = data;
+
+	use->account->bytes -= use->size;
+	icon_data_account_unref(use->account);
+	g_slice_free(IconDataUse, use);
+}
+
+/* Returns the data of the window whose menubar widget belongs to, if any */
+static WindowData *menu_item_peek_window_data(GtkWidget *widget)
+{
+	while (widget != NULL && !GTK_IS_MENU_BAR(widget))
+	{
+		if (GTK_IS_MENU(widget))
+			widget = gtk_menu_get_attach_widget(GTK_MENU(widget));
+		else
+			widget = gtk_widget_get_parent(widget);
+	}
+
+	if (widget != NULL)
+		widget = gtk_widget_get_toplevel(widget);
+
+	if (widget == NULL || !GTK_IS_WINDOW(widget))
+		return NULL;
+
+	return gtk_window_peek_window_data(GTK_WINDOW(widget));
+}
+
+static void on_icon_data_property_changed(DbusmenuMenuitem *item, const char *name,
+                                          GVariant *value, gpointer user_data)
+{
+	/* Removed by someone else, e.g. libdbusmenu-gtk for a new image */
+	if (value == NULL && g_strcmp0(name, "icon-data") == 0)
+		g_object_set_data(G_OBJECT(item), ICON_DATA_USE, NULL);
+}
+
+static void menu_item_set_icon_data(GtkWidget *widget, DbusmenuMenuitem *item, GVariant *data)
+{
+	WindowData *window_data = widget != NULL ? menu_item_peek_window_data(widget) : NULL;
+	IconDataUse *use        = NULL;
+
+	if (window_data != NULL && window_data->icon_data != NULL)
+	{
+		use          = g_slice_new0(IconDataUse);
+		use->account = window_data->icon_data;
+		use->size    = g_variant_get_size(data);
+		use->account->ref_count++;
+		use->account->bytes += use->size;
+	}
+
+	dbusmenu_menuitem_property_set_variant(item, "icon-data", data);
+	dbusmenu_menuitem_property_set_bool(item, "icon-visible", TRUE);
+
+	if (use != NULL && g_signal_handler_find(item,
+	                                         G_SIGNAL_MATCH_FUNC,
+	                                         0,
+	                                         0,
+	                                         NULL,
+	                                         on_icon_data_property_changed,
+	                                         NULL) == 0)
+		g_signal_connect(item,
+		                 DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED,
+		                 G_CALLBACK(on_icon_data_property_changed),
+		                 NULL);
+
+	/* Replacing the use releases the bytes of the previous icon-data */
+	g_object_set_data_full(G_OBJECT(item), ICON_DATA_USE, use, use != NULL ? icon_data_use_free : NULL);
+}
+
+static void menu_item_set_icon_pixbuf(GtkWidget *widget, DbusmenuMenuitem *item, IconKey *key,
+                                      GdkPixbuf *pixbuf)
+{
+	GVariant *data = icon_data_new(pixbuf);
+
+	if (data == NULL)
+		return;
+
+	icon_cache_insert(key, data, g_variant_get_size(data));
+	menu_item_set_icon_data(widget, item, data);
+	g_variant_unref(data);
+}
+
+static GtkIconTheme *widget_get_icon_theme(GtkWidget *widget)
+{
+	GdkScreen *screen = gtk_widget_get_screen(widget);
+
+	return screen ? gtk_icon_theme_get_for_screen(screen) : gtk_icon_theme_get_default();
+}
+
+/* Returns the image the icon of the menu item is taken from, if any */
+static GtkWidget *menu_item_get_image(GtkWidget *widget)
+{
+	GtkWidget *image = NULL;
+
+	G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+	if (GTK_IS_IMAGE_MENU_ITEM(widget))
+		image = gtk_image_menu_item_get_image(GTK_IMAGE_MENU_ITEM(widget));
+	G_GNUC_END_IGNORE_DEPRECATIONS
+
+	if (image == NULL && GTK_IS_BIN(widget))
+	{
+		GtkWidget *child = gtk_bin_get_child(GTK_BIN(widget));
+
+		if (GTK_IS_IMAGE(child))
+			image = child;
+		else if (GTK_IS_CONTAINER(child))
+		{
+			GList *children = gtk_container_get_children(GTK_CONTAINER(child));
+
+			for (GList *iter = children; iter != NULL && image == NULL; iter = iter->next)
+				if (GTK_IS_IMAGE(iter->data))
+					image = iter->data;
+
+			g_list_free(children);
+		}
+	}
+
+	return image != NULL && GTK_IS_IMAGE(image) ? image : NULL;
+}
+
+/* Returns the file a pixbuf shown by the menu item was loaded from, if known */
+static char *menu_item_get_image_file(GtkWidget *widget)
+{
+	GtkWidget *image = menu_item_get_image(widget);
+	char *file       = NULL;
+
+	if (image != NULL)
+		g_object_get(image, "file", &file, NULL);
+
+	return file;
+}
+
+/* Maps a file below one of the icon theme directories back to its icon name */
+static char *icon_theme_name_for_path(GtkIconTheme *icon_theme, const char *path)
+{
+	gchar **search_path = NULL;
+	gint n_elements     = 0;
+	char *name          = NULL;
+
+	gtk_icon_theme_get_search_path(icon_theme, &search_path, &n_elements);
+
+	for (gint i = 0; i < n_elements && name == NULL; i++)
+	{
+		gsize length = strlen(search_path[i]);
+
+		if (length > 0 && strncmp(path, search_path[i], length) == 0 && path[length] == '/')
+		{
+			char *basename = g_path_get_basename(path);
+			char *dot      = strrchr(basename, '.');
+
+			if (dot != NULL)
+				*dot = '\0';
+
+			/* foo.symbolic.png is looked up as foo-symbolic */
+			if (g_str_has_suffix(basename, ".symbolic"))
+				basename[strlen(basename) - strlen(".symbolic")] = '-';
+
+			if (basename[0] != '\0' && gtk_icon_theme_has_icon(icon_theme, basename))
+				name = basename;
+			else
+				g_free(basename);
+		}
+	}
+
+	g_strfreev(search_path);
+
+	return name;
+}
+
+/*
+ * Returns the icon-name to export for icon: a theme icon name, or failing that
+ * the absolute path of the file it comes from. Consumers resolve both on their
+ * side, so pixels only have to be sent when neither is known.
+ */
+static char *icon_resolve_name(GtkWidget *widget, GIcon *icon)
+{
+	char *path = NULL;
+	char *name = NULL;
+
+	if (G_IS_THEMED_ICON(icon))
+	{
+		const gchar *const *names = g_themed_icon_get_names(G_THEMED_ICON(icon));
+
+		if (names != NULL && names[0] != NULL)
+			return g_strdup(names[0]);
+
+		return NULL;
+	}
+
+	if (G_IS_FILE_ICON(icon))
+		path = g_file_get_path(g_file_icon_get_file(G_FILE_ICON(icon)));
+	else if (GDK_IS_PIXBUF(icon))
+		path = menu_item_get_image_file(widget);
+
+	if (path == NULL || !g_path_is_absolute(path) ||
+	    !g_file_test(path, G_FILE_TEST_IS_REGULAR))
+	{
+		g_free(path);
+		return NULL;
+	}
+
+	name = icon_theme_name_for_path(widget_get_icon_theme(widget), path);
+
+	if (name == NULL)
+		return path;
+
+	g_free(path);
+
+	return name;
+}
+
+static void icon_load_cancel(gpointer data)
+{
+	g_cancellable_cancel(data);
+	g_object_unref(data);
+}
+
+static void icon_load_free(IconLoad *load)
+{
+	if (load->widget != NULL)
+	{
+		GObject *widget = G_OBJECT(load->widget);
+
+		if (g_object_get_qdata(widget, appmenu_gtk_wayland_icon_load_quark()) ==
+		    load->cancellable)
+			g_object_unref(
+			    g_object_steal_qdata(widget, appmenu_gtk_wayland_icon_load_quark()));
+
+		g_object_remove_weak_pointer(widget, (gpointer *)&load->widget);
+	}
+
+	g_object_unref(load->cancellable);
+	g_object_unref(load->item);
+	g_object_unref(load->key.icon);
+	g_slice_free(IconLoad, load);
+}
+
+static void on_icon_loaded(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	IconLoad *load    = user_data;
+	GError *error     = NULL;
+	GdkPixbuf *pixbuf = gtk_icon_info_load_icon_finish(GTK_ICON_INFO(source), result, &error);
+
+	if (pixbuf == NULL)
+	{
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_debug("APPMENU-GTK-WAYLAND: failed to load icon: %s", error->message);
+
+		g_error_free(error);
+	}
+	else
+	{
+		if (!g_cancellable_is_cancelled(load->cancellable))
+		{
+			g_debug("APPMENU-GTK-WAYLAND: fixing icon-data for %p", load->widget);
+			menu_item_set_icon_pixbuf(load->widget, load->item, &load->key, pixbuf);
+		}
+
+		g_object_unref(pixbuf);
+	}
+
+	icon_load_free(load);
+}
+
+/*
+ * Rendering non-themed icons (SVG in particular) is slow, so it is done by
+ * gtk_icon_info_load_icon_async() on GIO's worker threads. The lookup itself
+ * stays on the main thread because GtkIconTheme is not thread-safe. The item
+ * is exported with a hidden icon until the pixbuf arrives.
+ */
+static void menu_item_load_icon(GtkWidget *widget, DbusmenuMenuitem *item, IconKey *key)
+{
+	GtkIconTheme *icon_theme = widget_get_icon_theme(widget);
+	GtkIconInfo *icon_info;
+	IconLoad *load;
+
+	if (g_object_get_qdata(G_OBJECT(widget), appmenu_gtk_wayland_icon_load_quark()) != NULL)
+		return;
+
+	icon_info = gtk_icon_theme_lookup_by_gicon_for_scale(icon_theme,
+	                                                     key->icon,
+	                                                     key->size,
+	                                                     key->scale,
+	                                                     GTK_ICON_LOOKUP_FORCE_SIZE);
+
+	if (icon_info == NULL)
+	{
+		g_debug("APPMENU-GTK-WAYLAND: no icon found for %p", widget);
+		return;
+	}
+
+	load              = g_slice_new0(IconLoad);
+	load->item        = g_object_ref(item);
+	load->widget      = widget;
+	load->cancellable = g_cancellable_new();
+	load->key.icon    = g_object_ref(key->icon);
+	load->key.size    = key->size;
+	load->key.scale   = key->scale;
+	g_object_add_weak_pointer(G_OBJECT(widget), (gpointer *)&load->widget);
+
+	g_object_set_qdata_full(G_OBJECT(widget),
+	                        appmenu_gtk_wayland_icon_load_quark(),
+	                        g_object_ref(load->cancellable),
+	                        icon_load_cancel);
+
+	dbusmenu_menuitem_property_set_bool(item, "icon-visible", FALSE);
+	gtk_icon_info_load_icon_async(icon_info, load->cancellable, on_icon_loaded, load);
+	g_object_unref(icon_info);
+}
+
+static DbusmenuMenuitem *menu_item_lookup(GtkWidget *widget)
+{
+	DbusmenuMenuitem *item = g_object_get_data(G_OBJECT(widget), "dbusmenu-gtk-item");
+
+	/* Fallback to internal lookup functions if data is not found directly */
+	if (item == NULL)
+		item = menu_tree_lookup_item(widget);
+
+	return item;
+}
+
+static void fix_dbusmenu_icon(GtkWidget *widget)
+{
+	DbusmenuMenuitem *item = menu_item_lookup(widget);
+
+	if (item == NULL)
+		return;
+
+	const gchar *existing_name = dbusmenu_menuitem_property_get(item, "icon-name");
+	GVariant *existing_data    = dbusmenu_menuitem_property_get_variant(item, "icon-data");
+
+	/* Only set the icon if it's not already set or is empty */
+	if ((existing_name == NULL || existing_name[0] == '\0') && existing_data == NULL)
+	{
+		/* gtk_menu_item_get_icon returns a new reference (strongly reffed)
+		 * to ensure the icon remains valid during processing.
+		 */
+		GIcon *icon = gtk_menu_item_get_icon(GTK_MENU_ITEM(widget));
+		if (icon != NULL)
+		{
+			char *name = icon_resolve_name(widget, icon);
+
+			if (name != NULL)
+			{
+				g_debug("APPMENU-GTK-WAYLAND: fixing icon-name: %s for %p", name, widget);
+				dbusmenu_menuitem_property_set(item, "icon-name", name);
+				dbusmenu_menuitem_property_set_bool(item, "icon-visible", TRUE);
+				g_free(name);
+			}
+			else
+			{
+				IconKey key;
+				GVariant *data;
+
+				icon_key_init(&key, widget, icon);
+				data = icon_cache_lookup(&key);
+
+				if (data != NULL)
+				{
+					g_debug("APPMENU-GTK-WAYLAND: cached icon-data for %p", widget);
+					menu_item_set_icon_data(widget, item, data);
+				}
+				else if (GDK_IS_PIXBUF(icon))
+				{
+					g_debug("APPMENU-GTK-WAYLAND: fixing icon-data for %p", widget);
+					menu_item_set_icon_pixbuf(widget, item, &key, GDK_PIXBUF(icon));
+				}
+				else
+				{
+					menu_item_load_icon(widget, item, &key);
+				}
+			}
+			g_object_unref(icon);
+		}
+	}
+}
+
+static void fix_dirty_icons(void)
+{
+	GHashTableIter iter;
+	gpointer widget;
+
+	if (icon_dirty_items == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, icon_dirty_items);
+
+	/* Items that are no longer exported are marked again if they get parsed */
+	while (g_hash_table_iter_next(&iter, &widget, NULL))
+	{
+		fix_dbusmenu_icon(widget);
+		g_hash_table_iter_remove(&iter);
+	}
+}
+
+static gboolean fix_dirty_icons_idle(gpointer data)
+{
+	icon_flush_source_id = 0;
+	fix_dirty_icons();
+
+	return G_SOURCE_REMOVE;
+}
+
+G_GNUC_INTERNAL void icons_schedule_fix(void)
+{
+	if (icon_flush_source_id == 0 && icon_dirty_items != NULL &&
+	    g_hash_table_size(icon_dirty_items) > 0)
+		icon_flush_source_id = g_idle_add(fix_dirty_icons_idle, NULL);
+}
+
+static void on_menu_show(GtkWidget *widget, gpointer user_data)
+{
+	g_debug("APPMENU-GTK-WAYLAND: menu show, fixing changed icons");
+	fix_dirty_icons();
+}
+
+static void on_icon_item_destroy(GtkWidget *widget, gpointer user_data)
+{
+	/* Cancels a load that is still in flight */
+	g_object_set_qdata(G_OBJECT(widget), appmenu_gtk_wayland_icon_load_quark(), NULL);
+
+	if (icon_dirty_items != NULL)
+		g_hash_table_remove(icon_dirty_items, widget);
+}
+
+static void on_icon_item_icon_changed(GtkWidget *widget)
+{
+	DbusmenuMenuitem *item = menu_item_lookup(widget);
+
+	/* Cancels a load of the old icon that is still in flight */
+	g_object_set_qdata(G_OBJECT(widget), appmenu_gtk_wayland_icon_load_quark(), NULL);
+
+	if (item == NULL)
+		return;
+
+	/* fix_dbusmenu_icon() leaves an item alone that already has an icon */
+	dbusmenu_menuitem_property_remove(item, "icon-name");
+	dbusmenu_menuitem_property_remove(item, "icon-data");
+
+	if (icon_dirty_items == NULL)
+		icon_dirty_items = g_hash_table_new(NULL, NULL);
+
+	g_hash_table_add(icon_dirty_items, widget);
+	icons_schedule_fix();
+}
+
+static void menu_item_watch_image(GtkWidget *widget)
+{
+	GtkWidget *image = menu_item_get_image(widget);
+
+	if (image == NULL ||
+	    g_object_get_qdata(G_OBJECT(widget), appmenu_gtk_wayland_icon_image_quark()) == image)
+		return;
+
+	/* Only compared against, the connections go away with either object */
+	g_object_set_qdata(G_OBJECT(widget), appmenu_gtk_wayland_icon_image_quark(), image);
+
+	for (gsize i = 0; i < G_N_ELEMENTS(ICON_IMAGE_PROPERTIES); i++)
+		g_signal_connect_object(image,
+		                        ICON_IMAGE_PROPERTIES[i],
+		                        G_CALLBACK(on_icon_item_icon_changed),
+		                        widget,
+		                        G_CONNECT_SWAPPED);
+}
+
+static void on_icon_item_image_notify(GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+	menu_item_watch_image(GTK_WIDGET(object));
+	on_icon_item_icon_changed(GTK_WIDGET(object));
+}
+
+static void on_icon_shell_insert(GtkMenuShell *menu_shell, GtkWidget *child, gint position,
+                                 gpointer user_data)
+{
+	mark_dbusmenu_icons(child, NULL);
+	icons_schedule_fix();
+}
+
+static void on_icon_item_submenu_notify(GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+	GtkWidget *submenu = gtk_menu_item_get_submenu(GTK_MENU_ITEM(object));
+
+	if (submenu != NULL)
+	{
+		mark_dbusmenu_icons(submenu, NULL);
+		icons_schedule_fix();
+	}
+}
+
+/*
+ * Marks the menu items below widget as needing an icon fix-up. Every menu
+ * item and shell is hooked the first time it is seen, so later insertions
+ * and submenu changes mark only the affected items and a shown menu costs
+ * as much as the items that changed since the last pass.
+ */
+static void mark_dbusmenu_icons(GtkWidget *widget, gpointer user_data)
+{
+	GObject *object = G_OBJECT(widget);
+
+	if (GTK_IS_MENU_ITEM(widget))
+	{
+		GtkWidget *submenu;
+
+		if (g_object_get_qdata(object, appmenu_gtk_wayland_icon_tracked_quark()) == NULL)
+		{
+			g_object_set_qdata(object, appmenu_gtk_wayland_icon_tracked_quark(), widget);
+			g_signal_connect(widget, "destroy", G_CALLBACK(on_icon_item_destroy), NULL);
+			g_signal_connect(widget,
+			                 "notify::submenu",
+			                 G_CALLBACK(on_icon_item_submenu_notify),
+			                 NULL);
+
+			G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+			if (GTK_IS_IMAGE_MENU_ITEM(widget))
+				g_signal_connect(widget,
+				                 "notify::image",
+				                 G_CALLBACK(on_icon_item_image_notify),
+				                 NULL);
+			G_GNUC_END_IGNORE_DEPRECATIONS
+		}
+
+		/* Later changes of the icon mark the item again */
+		menu_item_watch_image(widget);
+
+		/* Subtrees that are not exported yet are marked when they get parsed */
+		if (menu_item_lookup(widget) == NULL)
+			return;
+
+		if (icon_dirty_items == NULL)
+			icon_dirty_items = g_hash_table_new(NULL, NULL);
+
+		g_hash_table_add(icon_dirty_items, widget);
+
+		submenu = gtk_menu_item_get_submenu(GTK_MENU_ITEM(widget));
+
+		if (submenu != NULL)
+			mark_dbusmenu_icons(submenu, NULL);
+	}
+	else if (GTK_IS_MENU_SHELL(widget))
+	{
+		if (g_object_get_qdata(object, appmenu_gtk_wayland_icon_tracked_quark()) == NULL)
+		{
+			g_object_set_qdata(object, appmenu_gtk_wayland_icon_tracked_quark(), widget);
+			g_signal_connect(widget, "show", G_CALLBACK(on_menu_show), NULL);
+			g_signal_connect_after(widget, "insert", G_CALLBACK(on_icon_shell_insert), NULL);
+		}
+
+		gtk_container_foreach(GTK_CONTAINER(widget), mark_dbusmenu_icons, NULL);
+	}
+}
+
+G_GNUC_INTERNAL void gtk_widget_fix_menu_icons(GtkWidget *widget)
+{
+	mark_dbusmenu_icons(widget, NULL);
+	fix_dirty_icons();
+
+	/* Items whose dbusmenu counterpart is not there yet get another try */
+	icons_schedule_fix();
+}
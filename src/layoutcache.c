@@ -0,0 +1,583 @@
+/*
+ * appmenu-gtk-module
+ * Copyright 2012 Canonical Ltd.
+ * Copyright (C) 2015-2017 Konstantin Pugin <ria.freelander@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: Ryan Lortie <desrt@desrt.ca>
+ *          William Hua <william.hua@canonical.com>
+ *          Konstantin Pugin <ria.freelander@gmail.com>
+ *          Lester Carballo Perez <lestcape@gmail.com>
+ */
+
+#include "layoutcache.h"
+#include "consts.h"
+#include "menutree.h"
+#include "support.h"
+
+#include <stdbool.h>
+
+/*
+ * Panels call GetLayout every time a menu is opened, and DbusmenuServer
+ * serializes the whole requested subtree for each call. Instead, every
+ * exported item keeps the serialized (ia{sv}av) layout of its subtree,
+ * tagged with the subtree revision it was built at. A change to an item
+ * bumps the revision of the item and of its ancestors only, so a GetLayout
+ * after a change rebuilds the path to the root and reuses everything else.
+ *
+ * GetLayout calls for the paths of our servers are taken off the shared
+ * session bus connection by a filter and answered from the main context.
+ * Calls that ask for specific properties are left to the server. Setting
+ * APPMENU_GTK_LAYOUT_CACHE=0 turns the cache off.
+ *
+ * The revision in a reply is the one of the last LayoutUpdated. A call that
+ * comes in while the server still has a layout update queued is answered
+ * after it, so the revision always matches the layout it is sent with.
+ *
+ * In lazy mode the filter also sees the GetLayout calls it leaves to the
+ * server, even with the cache off, so the requested submenu is populated
+ * before the server reads it.
+ */
+
+#define LAYOUT_CACHE_ITEM "appmenu-gtk-layout-cache"
+#define LAYOUT_SERVER_ROOT "appmenu-gtk-layout-server"
+/* DbusmenuServer starts counting its layout revisions at 1 */
+#define LAYOUT_REVISION_INITIAL 1
+
+typedef struct
+{
+	/* Bumped whenever the item or one of its descendants changes */
+	guint revision;
+	guint layout_revision;
+	GVariant *layout;
+	GVariant *properties;
+} LayoutCache;
+
+/*
+ * Shared between the table and the calls queued for it, so a call outliving
+ * its server finds server cleared instead of a freed struct.
+ */
+typedef struct
+{
+	gint ref_count;
+	char *object_path;
+	/* Cleared when the server is finalized */
+	DbusmenuServer *server;
+	guint revision;
+	/* The rest is only used from the main context */
+	DbusmenuMenuitem *root;
+	/* Set by a change the server has not sent LayoutUpdated for yet */
+	bool layout_pending;
+	GSList *deferred_calls;
+} LayoutServer;
+
+/* Object path to LayoutServer, the filter looks paths up from the GDBus thread */
+static GHashTable *layout_servers = NULL;
+static GMutex layout_servers_lock;
+static guint layout_filter_id = 0;
+
+static bool layout_cache_is_enabled(void)
+{
+	static int enabled = -1;
+
+	if (enabled < 0)
+		enabled = module_env_get_uint(LAYOUT_CACHE_ENV, 1) != 0;
+
+	return enabled;
+}
+
+static void layout_cache_invalidate(DbusmenuMenuitem *item)
+{
+	for (; item != NULL; item = dbusmenu_menuitem_get_parent(item))
+	{
+		LayoutCache *cache = g_object_get_data(G_OBJECT(item), LAYOUT_CACHE_ITEM);
+
+		if (cache == NULL)
+			break;
+
+		cache->revision++;
+
+		/* An ancestor of an outdated subtree cannot be up to date itself */
+		if (cache->layout == NULL)
+			break;
+
+		g_clear_pointer(&cache->layout, g_variant_unref);
+	}
+}
+
+/* Notes a change of the children of item, the server sends LayoutUpdated for
+ * it from an idle */
+static void layout_cache_layout_changed(DbusmenuMenuitem *item)
+{
+	LayoutServer *layout_server;
+
+	while (dbusmenu_menuitem_get_parent(item) != NULL)
+		item = dbusmenu_menuitem_get_parent(item);
+
+	layout_server = g_object_get_data(G_OBJECT(item), LAYOUT_SERVER_ROOT);
+
+	if (layout_server != NULL && layout_server->root == item)
+		layout_server->layout_pending = true;
+}
+
+static void on_item_property_changed(DbusmenuMenuitem *item, const char *name, GVariant *value,
+                                     gpointer user_data)
+{
+	LayoutCache *cache = user_data;
+
+	g_clear_pointer(&cache->properties, g_variant_unref);
+	layout_cache_invalidate(item);
+}
+
+static void on_item_child_added(DbusmenuMenuitem *item, GObject *child, guint position,
+                                gpointer user_data)
+{
+	layout_cache_invalidate(item);
+	layout_cache_layout_changed(item);
+}
+
+static void on_item_child_removed(DbusmenuMenuitem *item, GObject *child, gpointer user_data)
+{
+	layout_cache_invalidate(item);
+	layout_cache_layout_changed(item);
+}
+
+static void on_item_child_moved(DbusmenuMenuitem *item, GObject *child, guint new_position,
+                                guint old_position, gpointer user_data)
+{
+	layout_cache_invalidate(item);
+	layout_cache_layout_changed(item);
+}
+
+static void layout_cache_free(gpointer data)
+{
+	LayoutCache *cache = data;
+
+	g_clear_pointer(&cache->layout, g_variant_unref);
+	g_clear_pointer(&cache->properties, g_variant_unref);
+	g_slice_free(LayoutCache, cache);
+}
+
+/* Starts caching the layout of item, call before it can change */
+G_GNUC_INTERNAL void layout_cache_track_item(DbusmenuMenuitem *item)
+{
+	LayoutCache *cache;
+
+	if (!layout_cache_is_enabled() ||
+	    g_object_get_data(G_OBJECT(item), LAYOUT_CACHE_ITEM) != NULL)
+		return;
+
+	cache = g_slice_new0(LayoutCache);
+	g_object_set_data_full(G_OBJECT(item), LAYOUT_CACHE_ITEM, cache, layout_cache_free);
+
+	g_signal_connect(item,
+	                 DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED,
+	                 G_CALLBACK(on_item_property_changed),
+	                 cache);
+	g_signal_connect(item,
+	                 DBUSMENU_MENUITEM_SIGNAL_CHILD_ADDED,
+	                 G_CALLBACK(on_item_child_added),
+	                 NULL);
+	g_signal_connect(item,
+	                 DBUSMENU_MENUITEM_SIGNAL_CHILD_REMOVED,
+	                 G_CALLBACK(on_item_child_removed),
+	                 NULL);
+	g_signal_connect(item,
+	                 DBUSMENU_MENUITEM_SIGNAL_CHILD_MOVED,
+	                 G_CALLBACK(on_item_child_moved),
+	                 NULL);
+}
+
+/* Returns a new reference to the a{sv} of all properties of item */
+static GVariant *layout_cache_get_properties(DbusmenuMenuitem *item, LayoutCache *cache)
+{
+	GVariant *properties;
+
+	if (cache->properties != NULL)
+		return g_variant_ref(cache->properties);
+
+	properties = dbusmenu_menuitem_properties_variant(item, NULL);
+
+	if (properties == NULL)
+		properties = g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0);
+
+	cache->properties = g_variant_ref_sink(properties);
+
+	return g_variant_ref(properties);
+}
+
+/*
+ * Serializes item like dbusmenu_menuitem_build_variant() with all properties,
+ * descending depth levels or the whole subtree for a negative depth. Returns
+ * a new reference.
+ */
+static GVariant *layout_cache_build(DbusmenuMenuitem *item, gint depth)
+{
+	GList *children = dbusmenu_menuitem_get_children(item);
+	LayoutCache *cache;
+	GVariantBuilder builder;
+	GVariant *properties;
+	GVariant *layout;
+	gint id;
+
+	/* Items we did not build ourselves start being tracked here */
+	layout_cache_track_item(item);
+	cache = g_object_get_data(G_OBJECT(item), LAYOUT_CACHE_ITEM);
+
+	if (depth < 0 && cache->layout != NULL && cache->layout_revision == cache->revision)
+		return g_variant_ref(cache->layout);
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("av"));
+
+	if (depth != 0)
+	{
+		for (GList *iter = children; iter != NULL; iter = g_list_next(iter))
+		{
+			GVariant *child = layout_cache_build(iter->data, depth - 1);
+
+			g_variant_builder_add_value(&builder, g_variant_new_variant(child));
+			g_variant_unref(child);
+		}
+	}
+
+	id         = dbusmenu_menuitem_get_root(item) ? 0 : dbusmenu_menuitem_get_id(item);
+	properties = layout_cache_get_properties(item, cache);
+	layout     = g_variant_new("(i@a{sv}@av)", id, properties, g_variant_builder_end(&builder));
+	g_variant_ref_sink(layout);
+	g_variant_unref(properties);
+
+	if (depth < 0)
+	{
+		g_clear_pointer(&cache->layout, g_variant_unref);
+		cache->layout          = g_variant_ref(layout);
+		cache->layout_revision = cache->revision;
+	}
+
+	return layout;
+}
+
+static void layout_cache_reply_error(GDBusConnection *connection, GDBusMessage *message,
+                                     const char *error_name, const char *error_message)
+{
+	GDBusMessage *reply = g_dbus_message_new_method_error_literal(message,
+	                                                              error_name,
+	                                                              error_message);
+
+	g_dbus_connection_send_message(connection, reply, G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, NULL);
+	g_object_unref(reply);
+}
+
+static LayoutServer *layout_server_ref(LayoutServer *layout_server)
+{
+	g_atomic_int_inc(&layout_server->ref_count);
+
+	return layout_server;
+}
+
+static void layout_server_unref(gpointer data)
+{
+	LayoutServer *layout_server = data;
+
+	if (g_atomic_int_dec_and_test(&layout_server->ref_count))
+	{
+		g_free(layout_server->object_path);
+		g_slice_free(LayoutServer, layout_server);
+	}
+}
+
+typedef struct
+{
+	GDBusConnection *connection;
+	GDBusMessage *message;
+	LayoutServer *layout_server;
+} LayoutCall;
+
+static void layout_call_free(LayoutCall *call)
+{
+	layout_server_unref(call->layout_server);
+	g_object_unref(call->connection);
+	g_object_unref(call->message);
+	g_slice_free(LayoutCall, call);
+}
+
+/* The parent item a GetLayout call asks for, with its children populated */
+static DbusmenuMenuitem *layout_call_prepare_parent(LayoutCall *call, gint *depth)
+{
+	DbusmenuMenuitem *root = NULL;
+	DbusmenuMenuitem *item = NULL;
+	gint parent;
+
+	g_variant_get(g_dbus_message_get_body(call->message), "(ii^a&s)", &parent, depth, NULL);
+
+	if (call->layout_server->server != NULL)
+		g_object_get(call->layout_server->server, DBUSMENU_SERVER_PROP_ROOT_NODE, &root, NULL);
+
+	if (root != NULL)
+	{
+		item = dbusmenu_menuitem_find_id(root, parent);
+		g_object_unref(root);
+	}
+
+	if (item != NULL)
+		menu_tree_prepare_layout(item);
+
+	return item;
+}
+
+/* Runs ahead of the server handling a GetLayout we left to it */
+static gboolean layout_cache_prepare_call(gpointer user_data)
+{
+	gint depth;
+
+	layout_call_prepare_parent(user_data, &depth);
+	layout_call_free(user_data);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean layout_cache_handle_call(gpointer user_data)
+{
+	LayoutCall *call            = user_data;
+	GDBusMessage *message       = call->message;
+	LayoutServer *layout_server = call->layout_server;
+	DbusmenuMenuitem *item;
+	GDBusMessage *reply;
+	GVariant *layout;
+	gint depth;
+
+	item = layout_call_prepare_parent(call, &depth);
+
+	if (layout_server->server == NULL)
+	{
+		layout_cache_reply_error(call->connection,
+		                         message,
+		                         "org.freedesktop.DBus.Error.UnknownObject",
+		                         "The menu is no longer exported");
+	}
+	else if (item == NULL)
+	{
+		layout_cache_reply_error(call->connection,
+		                         message,
+		                         "org.freedesktop.DBus.Error.InvalidArgs",
+		                         "The ID supplied does not refer to a menu item we have");
+	}
+	else if (layout_server->layout_pending)
+	{
+		/* Answered from on_server_layout_updated() with the new revision */
+		layout_server->deferred_calls = g_slist_append(layout_server->deferred_calls, call);
+
+		return G_SOURCE_REMOVE;
+	}
+	else if ((g_dbus_message_get_flags(message) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED) == 0)
+	{
+		layout = layout_cache_build(item, depth);
+		reply  = g_dbus_message_new_method_reply(message);
+		g_dbus_message_set_body(reply,
+		                        g_variant_new("(u@(ia{sv}av))", layout_server->revision, layout));
+		g_dbus_connection_send_message(call->connection,
+		                               reply,
+		                               G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+		                               NULL,
+		                               NULL);
+		g_object_unref(reply);
+		g_variant_unref(layout);
+	}
+
+	layout_call_free(call);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Runs in the GDBus worker thread */
+static GDBusMessage *layout_cache_filter(GDBusConnection *connection, GDBusMessage *message,
+                                         gboolean incoming, gpointer user_data)
+{
+	const char *interface = g_dbus_message_get_interface(message);
+	LayoutServer *layout_server;
+	GVariant *body;
+	const char **names;
+	bool ours;
+	LayoutCall *call;
+
+	/* The interface header is optional, the path and member decide then */
+	if (!incoming || g_dbus_message_get_message_type(message) != G_DBUS_MESSAGE_TYPE_METHOD_CALL ||
+	    (interface != NULL && g_strcmp0(interface, DBUSMENU_INTERFACE) != 0) ||
+	    g_strcmp0(g_dbus_message_get_member(message), "GetLayout") != 0)
+		return message;
+
+	body = g_dbus_message_get_body(message);
+
+	if (body == NULL || !g_variant_is_of_type(body, G_VARIANT_TYPE("(iias)")))
+		return message;
+
+	g_variant_get(body, "(ii^a&s)", NULL, NULL, &names);
+
+	/* Only the full set of properties is cached */
+	ours = layout_cache_is_enabled() && (names == NULL || names[0] == NULL);
+	g_free(names);
+
+	if (!ours && !menu_tree_is_lazy())
+		return message;
+
+	g_mutex_lock(&layout_servers_lock);
+	layout_server = g_hash_table_lookup(layout_servers, g_dbus_message_get_path(message));
+
+	if (layout_server != NULL)
+		layout_server_ref(layout_server);
+
+	g_mutex_unlock(&layout_servers_lock);
+
+	if (layout_server == NULL)
+		return message;
+
+	call                = g_slice_new0(LayoutCall);
+	call->connection    = g_object_ref(connection);
+	call->message       = g_object_ref(message);
+	call->layout_server = layout_server;
+
+	/* Dispatched before the idle GDBus queues for the server's own handler */
+	if (!ours)
+	{
+		g_idle_add_full(G_PRIORITY_HIGH, layout_cache_prepare_call, call, NULL);
+
+		return message;
+	}
+
+	g_object_unref(message);
+
+	/* GDBus dispatches the other method calls at the default priority too, so
+	 * a GetLayout is answered after an AboutToShow or Event sent before it */
+	g_idle_add(layout_cache_handle_call, call);
+
+	return NULL;
+}
+
+/* Answers the calls that waited for a LayoutUpdated, or for the server to go */
+static void layout_server_answer_deferred(LayoutServer *layout_server)
+{
+	GSList *calls = layout_server->deferred_calls;
+
+	layout_server->deferred_calls = NULL;
+
+	for (GSList *iter = calls; iter != NULL; iter = g_slist_next(iter))
+		layout_cache_handle_call(iter->data);
+
+	g_slist_free(calls);
+}
+
+static void on_session_bus_ready(GObject *object, GDBusConnection *connection)
+{
+	if (layout_filter_id == 0)
+		layout_filter_id =
+		    g_dbus_connection_add_filter(connection, layout_cache_filter, NULL, NULL);
+}
+
+static void on_server_layout_updated(DbusmenuServer *server, guint revision, gint parent,
+                                     gpointer user_data)
+{
+	LayoutServer *layout_server = user_data;
+
+	layout_server->revision       = revision;
+	layout_server->layout_pending = false;
+	layout_server_answer_deferred(layout_server);
+}
+
+static void layout_server_set_root(LayoutServer *layout_server, DbusmenuMenuitem *root)
+{
+	if (layout_server->root != NULL)
+	{
+		g_object_set_data(G_OBJECT(layout_server->root), LAYOUT_SERVER_ROOT, NULL);
+		g_object_unref(layout_server->root);
+	}
+
+	layout_server->root = root;
+
+	if (root != NULL)
+		g_object_set_data_full(G_OBJECT(root),
+		                       LAYOUT_SERVER_ROOT,
+		                       layout_server_ref(layout_server),
+		                       layout_server_unref);
+}
+
+static void on_server_root_changed(DbusmenuServer *server, GParamSpec *pspec, gpointer user_data)
+{
+	LayoutServer *layout_server = user_data;
+	DbusmenuMenuitem *root      = NULL;
+
+	g_object_get(server, DBUSMENU_SERVER_PROP_ROOT_NODE, &root, NULL);
+	layout_server_set_root(layout_server, root);
+	layout_server->layout_pending = true;
+}
+
+static void on_server_finalized(gpointer data, GObject *server)
+{
+	LayoutServer *layout_server = data;
+
+	/* A new server may already be exported at the same path */
+	g_mutex_lock(&layout_servers_lock);
+
+	if (g_hash_table_lookup(layout_servers, layout_server->object_path) == layout_server)
+		g_hash_table_remove(layout_servers, layout_server->object_path);
+
+	g_mutex_unlock(&layout_servers_lock);
+
+	layout_server->server         = NULL;
+	layout_server->layout_pending = false;
+	layout_server_set_root(layout_server, NULL);
+	layout_server_answer_deferred(layout_server);
+	layout_server_unref(layout_server);
+}
+
+/* Answers the GetLayout calls for server, which is exported at object_path */
+G_GNUC_INTERNAL void layout_cache_track_server(DbusmenuServer *server, const char *object_path)
+{
+	DbusmenuMenuitem *root = NULL;
+	LayoutServer *layout_server;
+
+	if (!layout_cache_is_enabled() && !menu_tree_is_lazy())
+		return;
+
+	layout_server              = g_slice_new0(LayoutServer);
+	layout_server->ref_count   = 1;
+	layout_server->object_path = g_strdup(object_path);
+	layout_server->server      = server;
+	layout_server->revision    = LAYOUT_REVISION_INITIAL;
+
+	g_mutex_lock(&layout_servers_lock);
+
+	if (layout_servers == NULL)
+		layout_servers =
+		    g_hash_table_new_full(g_str_hash, g_str_equal, NULL, layout_server_unref);
+
+	/* The key is owned by the value, so replace both */
+	g_hash_table_remove(layout_servers, object_path);
+	g_hash_table_insert(layout_servers,
+	                    layout_server->object_path,
+	                    layout_server_ref(layout_server));
+	g_mutex_unlock(&layout_servers_lock);
+
+	g_signal_connect(server,
+	                 DBUSMENU_SERVER_SIGNAL_LAYOUT_UPDATED,
+	                 G_CALLBACK(on_server_layout_updated),
+	                 layout_server);
+	g_object_get(server, DBUSMENU_SERVER_PROP_ROOT_NODE, &root, NULL);
+	layout_server_set_root(layout_server, root);
+	g_signal_connect(server,
+	                 "notify::" DBUSMENU_SERVER_PROP_ROOT_NODE,
+	                 G_CALLBACK(on_server_root_changed),
+	                 layout_server);
+	g_object_weak_ref(G_OBJECT(server), on_server_finalized, layout_server);
+	session_bus_when_ready(G_OBJECT(server), on_session_bus_ready);
+}
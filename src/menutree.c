@@ -0,0 +1,1216 @@
+/*
+ * appmenu-gtk-module
+ * Copyright 2012 Canonical Ltd.
+ * Copyright (C) 2015-2017 Konstantin Pugin <ria.freelander@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: Ryan Lortie <desrt@desrt.ca>
+ *          William Hua <william.hua@canonical.com>
+ *          Konstantin Pugin <ria.freelander@gmail.com>
+ *          Lester Carballo Perez <lestcape@gmail.com>
+ */
+
+#include "menutree.h"
+#include "batch.h"
+#include "consts.h"
+#include "icons.h"
+#include "layoutcache.h"
+#include "support.h"
+
+#include <libdbusmenu-gtk/parser.h>
+
+/* libdbusmenu-gtk internal but exported functions */
+DbusmenuMenuitem *dbusmenu_gtk_parse_get_cached_item(GtkWidget *widget);
+
+/* Key under which libdbusmenu-gtk caches the item it built for a widget */
+#define PARSER_CACHED_ITEM "dbusmenu-gtk-parser-cached-item"
+#define MENU_NODE "appmenu-gtk-menu-node"
+
+/*
+ * A MenuNode mirrors GtkMenuShells into the children of a DbusmenuMenuitem.
+ * Submenu nodes mirror exactly one shell; the root node of a window mirrors
+ * every menubar attached to it, one after the other, so the window needs a
+ * single DbusmenuServer however many menubars it has.
+ *
+ * In lazy mode the children are only created once the consumer opens the
+ * submenu (AboutToShow or the "opened" event) or asks for its layout, and are
+ * dropped again when the submenu has stayed closed for LAZY_EXPIRE_ENV
+ * seconds. Otherwise the whole
+ * tree is populated up front. Leaf items are always built by libdbusmenu-gtk,
+ * which knows about check, radio and accelerators.
+ */
+typedef struct _MenuNode MenuNode;
+
+/*
+ * One exported child of a shell. When an item is reused for a new widget
+ * (see menu_node_shell_reconcile()) and is a leaf, the new widget's
+ * libdbusmenu-gtk item is kept as a shadow whose properties are forwarded
+ * to the exported item and which receives its events.
+ */
+typedef struct
+{
+	GtkWidget *widget;
+	DbusmenuMenuitem *item;
+	DbusmenuMenuitem *shadow;
+	gulong shadow_handler_id;
+	gulong event_handler_id;
+} MenuEntry;
+
+typedef struct
+{
+	MenuNode *node;
+	GtkWidget *shell;
+	GPtrArray *entries;
+	GList *pending;
+	bool queued;
+	bool dirty;
+	gulong insert_handler_id;
+	gulong remove_handler_id;
+} MenuNodeShell;
+
+struct _MenuNode
+{
+	MenuNode *root;
+	DbusmenuMenuitem *item;
+	GtkWidget *widget;
+	GSList *shells;
+	guint expire_source_id;
+	bool populated;
+
+	/* Only used on the root */
+	guint n_pending;
+	MenuTreeCompleteFunc complete_func;
+	gpointer complete_data;
+};
+
+/*
+ * Outside lazy mode submenus are not built inside realize or map: their
+ * shells queue up the items still to build in MenuNodeShell.pending, and an
+ * idle source builds them EXPORT_SLICE_ENV milliseconds at a time. Top level
+ * items are built right away and deeper levels are queued behind shallower
+ * ones, so the consumer gets the menubar first.
+ */
+static GQueue export_queue    = G_QUEUE_INIT;
+static guint export_source_id = 0;
+
+/*
+ * Shell insertions and removals are not applied one by one: the shell is
+ * marked dirty and menu_node_shell_reconcile() later diffs its children
+ * against the exported entries, so an application rebuilding a submenu
+ * from scratch keeps the IDs of the entries that did not change.
+ */
+static GQueue reconcile_queue    = G_QUEUE_INIT;
+static guint reconcile_source_id = 0;
+
+/* Eagerly populated subtrees get their icons fixed in one pass at the top */
+static guint populate_depth = 0;
+
+G_GNUC_INTERNAL G_DEFINE_QUARK(appmenu_gtk_wayland_menu_item, appmenu_gtk_wayland_menu_item);
+
+static DbusmenuMenuitem *menu_node_build_item(MenuNode *parent, GtkWidget *widget);
+static void menu_node_bind_widget(MenuNode *node, GtkWidget *widget);
+static void menu_node_set_shell(MenuNode *node, GtkWidget *shell);
+static void menu_node_populate(MenuNode *node);
+static void menu_node_fix_icons(MenuNode *node);
+static void menu_node_unpopulate(MenuNode *node);
+
+G_GNUC_INTERNAL bool menu_tree_is_lazy(void)
+{
+	static int lazy = -1;
+
+	if (lazy < 0)
+		lazy = g_strcmp0(g_getenv(MENU_MODE_ENV), MENU_MODE_LAZY) == 0;
+
+	return lazy;
+}
+
+/*
+ * Hooks item up before it is exported. The layout cache has to see property
+ * changes before batching holds them back from the server.
+ */
+static void menu_tree_track_item(DbusmenuMenuitem *item)
+{
+	layout_cache_track_item(item);
+	batch_track_item(item);
+}
+
+static guint menu_tree_get_slice_ms(void)
+{
+	static int slice_ms = -1;
+
+	if (slice_ms < 0)
+		slice_ms = (int)module_env_get_uint(EXPORT_SLICE_ENV, EXPORT_SLICE_DEFAULT);
+
+	return (guint)slice_ms;
+}
+
+G_GNUC_INTERNAL DbusmenuMenuitem *menu_tree_lookup_item(GtkWidget *widget)
+{
+	DbusmenuMenuitem *item;
+
+	if (!GTK_IS_MENU_ITEM(widget))
+		return NULL;
+
+	item = g_object_get_qdata(G_OBJECT(widget), appmenu_gtk_wayland_menu_item_quark());
+
+	if (item == NULL)
+		item = dbusmenu_gtk_parse_get_cached_item(widget);
+
+	return item;
+}
+
+static void menu_node_sync(MenuNode *node)
+{
+	const char *label;
+
+	if (node->widget == NULL)
+		return;
+
+	label = gtk_menu_item_get_label(GTK_MENU_ITEM(node->widget));
+
+	dbusmenu_menuitem_property_set(node->item,
+	                               DBUSMENU_MENUITEM_PROP_LABEL,
+	                               label != NULL ? label : "");
+	dbusmenu_menuitem_property_set_bool(node->item,
+	                                    DBUSMENU_MENUITEM_PROP_ENABLED,
+	                                    gtk_widget_get_sensitive(node->widget));
+	dbusmenu_menuitem_property_set_bool(node->item,
+	                                    DBUSMENU_MENUITEM_PROP_VISIBLE,
+	                                    gtk_widget_get_visible(node->widget));
+
+	if (node->shells != NULL)
+		dbusmenu_menuitem_property_set(node->item,
+		                               DBUSMENU_MENUITEM_PROP_CHILD_DISPLAY,
+		                               DBUSMENU_MENUITEM_CHILD_DISPLAY_SUBMENU);
+	else
+		dbusmenu_menuitem_property_remove(node->item, DBUSMENU_MENUITEM_PROP_CHILD_DISPLAY);
+}
+
+static MenuEntry *menu_entry_new(GtkWidget *widget, DbusmenuMenuitem *item)
+{
+	MenuEntry *entry = g_slice_new0(MenuEntry);
+
+	entry->widget = g_object_ref(widget);
+	entry->item   = item;
+
+	return entry;
+}
+
+static void menu_entry_drop_shadow(MenuEntry *entry)
+{
+	if (entry->shadow != NULL)
+	{
+		g_signal_handler_disconnect(entry->shadow, entry->shadow_handler_id);
+		g_object_unref(entry->shadow);
+	}
+
+	entry->shadow            = NULL;
+	entry->shadow_handler_id = 0;
+}
+
+static void menu_entry_free(gpointer data)
+{
+	MenuEntry *entry = data;
+
+	menu_entry_drop_shadow(entry);
+
+	if (entry->event_handler_id != 0)
+		g_signal_handler_disconnect(entry->item, entry->event_handler_id);
+
+	g_object_unref(entry->item);
+	g_object_unref(entry->widget);
+	g_slice_free(MenuEntry, entry);
+}
+
+/* Position of the first child of node_shell among the children of its node */
+static guint menu_node_shell_get_offset(MenuNodeShell *node_shell)
+{
+	guint offset = 0;
+
+	for (GSList *iter = node_shell->node->shells; iter->data != node_shell; iter = iter->next)
+		offset += ((MenuNodeShell *)iter->data)->entries->len;
+
+	return offset;
+}
+
+/* Exports item, built for widget, after the other children of node_shell */
+static void menu_node_shell_append(MenuNodeShell *node_shell, GtkWidget *widget,
+                                   DbusmenuMenuitem *item)
+{
+	dbusmenu_menuitem_child_add_position(node_shell->node->item,
+	                                     item,
+	                                     menu_node_shell_get_offset(node_shell) +
+	                                         node_shell->entries->len);
+	g_ptr_array_add(node_shell->entries, menu_entry_new(widget, item));
+}
+
+static void menu_tree_check_complete(MenuNode *root)
+{
+	if (root->n_pending == 0 && root->complete_func != NULL)
+		root->complete_func(root->complete_data);
+}
+
+/* Builds the next queued item of node_shell; returns false once none is left */
+static bool menu_node_shell_build_next(MenuNodeShell *node_shell)
+{
+	GtkWidget *widget;
+	DbusmenuMenuitem *item;
+
+	if (node_shell->pending == NULL)
+		return false;
+
+	widget              = node_shell->pending->data;
+	node_shell->pending = g_list_delete_link(node_shell->pending, node_shell->pending);
+
+	populate_depth++;
+	item = menu_node_build_item(node_shell->node, widget);
+	populate_depth--;
+
+	if (item != NULL)
+		menu_node_shell_append(node_shell, widget, item);
+
+	g_object_unref(widget);
+
+	return node_shell->pending != NULL;
+}
+
+static void menu_node_shell_dequeue(MenuNodeShell *node_shell)
+{
+	g_queue_remove(&export_queue, node_shell);
+	node_shell->queued = false;
+	node_shell->node->root->n_pending--;
+}
+
+/* Drops the items node_shell still had queued, without building them */
+static void menu_node_shell_cancel_pending(MenuNodeShell *node_shell)
+{
+	if (!node_shell->queued)
+		return;
+
+	g_list_free_full(node_shell->pending, g_object_unref);
+	node_shell->pending = NULL;
+	menu_node_shell_dequeue(node_shell);
+}
+
+static void menu_node_shell_complete(MenuNodeShell *node_shell)
+{
+	MenuNode *root = node_shell->node->root;
+
+	menu_node_shell_dequeue(node_shell);
+
+	if (node_shell->shell != NULL)
+		gtk_widget_fix_menu_icons(node_shell->shell);
+
+	menu_tree_check_complete(root);
+}
+
+/* Builds whatever node_shell still has queued right away */
+static void menu_node_shell_flush_pending(MenuNodeShell *node_shell)
+{
+	if (!node_shell->queued)
+		return;
+
+	while (menu_node_shell_build_next(node_shell))
+		;
+
+	menu_node_shell_complete(node_shell);
+}
+
+static gboolean menu_tree_export_slice(gpointer user_data)
+{
+	gint64 deadline = g_get_monotonic_time() + (gint64)menu_tree_get_slice_ms() * 1000;
+
+	while (!g_queue_is_empty(&export_queue) && g_get_monotonic_time() < deadline)
+	{
+		MenuNodeShell *node_shell = g_queue_peek_head(&export_queue);
+
+		if (!menu_node_shell_build_next(node_shell))
+			menu_node_shell_complete(node_shell);
+	}
+
+	if (!g_queue_is_empty(&export_queue))
+		return G_SOURCE_CONTINUE;
+
+	export_source_id = 0;
+
+	return G_SOURCE_REMOVE;
+}
+
+static void menu_node_shell_queue(MenuNodeShell *node_shell, GList *widgets)
+{
+	for (GList *iter = widgets; iter != NULL; iter = g_list_next(iter))
+		if (GTK_IS_MENU_ITEM(iter->data))
+			node_shell->pending = g_list_prepend(node_shell->pending, g_object_ref(iter->data));
+
+	if (node_shell->pending == NULL)
+		return;
+
+	node_shell->pending = g_list_reverse(node_shell->pending);
+	node_shell->queued  = true;
+	g_queue_push_tail(&export_queue, node_shell);
+	node_shell->node->root->n_pending++;
+
+	if (export_source_id == 0)
+		export_source_id =
+		    g_idle_add_full(G_PRIORITY_LOW, menu_tree_export_slice, NULL, NULL);
+}
+
+static void on_shadow_property_changed(DbusmenuMenuitem *shadow, const char *property,
+                                       GVariant *value, gpointer user_data)
+{
+	DbusmenuMenuitem *item = user_data;
+
+	if (value != NULL)
+		dbusmenu_menuitem_property_set_variant(item, property, value);
+	else
+		dbusmenu_menuitem_property_remove(item, property);
+}
+
+static gboolean on_proxy_event(DbusmenuMenuitem *item, const char *name, GVariant *value,
+                               guint timestamp, gpointer user_data)
+{
+	MenuEntry *entry = user_data;
+
+	if (entry->shadow == NULL)
+		return FALSE;
+
+	/* The widget item was built for is gone, activate the current one */
+	dbusmenu_menuitem_handle_event(entry->shadow, name, value, timestamp);
+
+	return TRUE;
+}
+
+/* Makes the properties of target equal to those of source */
+static void menu_item_copy_properties(DbusmenuMenuitem *target, DbusmenuMenuitem *source)
+{
+	GList *names = dbusmenu_menuitem_properties_list(target);
+	GSList *stale = NULL;
+
+	for (GList *iter = names; iter != NULL; iter = g_list_next(iter))
+		if (dbusmenu_menuitem_property_get_variant(source, iter->data) == NULL)
+			stale = g_slist_prepend(stale, g_strdup(iter->data));
+
+	g_list_free(names);
+
+	for (GSList *iter = stale; iter != NULL; iter = g_slist_next(iter))
+		dbusmenu_menuitem_property_remove(target, iter->data);
+
+	g_slist_free_full(stale, g_free);
+
+	names = dbusmenu_menuitem_properties_list(source);
+
+	for (GList *iter = names; iter != NULL; iter = g_list_next(iter))
+		dbusmenu_menuitem_property_set_variant(target,
+		                                       iter->data,
+		                                       dbusmenu_menuitem_property_get_variant(source,
+		                                                                              iter->data));
+
+	g_list_free(names);
+}
+
+/* Whether the item of entry can be reused for widget */
+static bool menu_entry_matches(MenuEntry *entry, GtkWidget *widget)
+{
+	bool is_node  = g_object_get_data(G_OBJECT(entry->item), MENU_NODE) != NULL;
+	bool has_menu = gtk_menu_item_get_submenu(GTK_MENU_ITEM(widget)) != NULL;
+
+	return is_node == has_menu && G_OBJECT_TYPE(entry->widget) == G_OBJECT_TYPE(widget) &&
+	       g_strcmp0(gtk_menu_item_get_label(GTK_MENU_ITEM(entry->widget)),
+	                 gtk_menu_item_get_label(GTK_MENU_ITEM(widget))) == 0;
+}
+
+/* Points the exported item of entry at widget, keeping the item's ID */
+static bool menu_entry_rebind(MenuEntry *entry, GtkWidget *widget)
+{
+	MenuNode *node = g_object_get_data(G_OBJECT(entry->item), MENU_NODE);
+
+	if (node != NULL)
+	{
+		menu_node_bind_widget(node, widget);
+		menu_node_set_shell(node, gtk_menu_item_get_submenu(GTK_MENU_ITEM(widget)));
+		menu_node_sync(node);
+
+		if (!menu_tree_is_lazy())
+			menu_node_populate(node);
+	}
+	else
+	{
+		DbusmenuMenuitem *shadow = dbusmenu_gtk_parse_menu_structure(widget);
+
+		if (shadow == NULL)
+			return false;
+
+		menu_entry_drop_shadow(entry);
+		entry->shadow            = shadow;
+		entry->shadow_handler_id = g_signal_connect(shadow,
+		                                            DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED,
+		                                            G_CALLBACK(on_shadow_property_changed),
+		                                            entry->item);
+		menu_item_copy_properties(entry->item, shadow);
+
+		if (entry->event_handler_id == 0)
+			entry->event_handler_id = g_signal_connect(entry->item,
+			                                           DBUSMENU_MENUITEM_SIGNAL_EVENT,
+			                                           G_CALLBACK(on_proxy_event),
+			                                           entry);
+	}
+
+	g_object_unref(entry->widget);
+	entry->widget = g_object_ref(widget);
+
+	return true;
+}
+
+/*
+ * Brings the exported children of node_shell in line with its shell: entries
+ * whose widget is still there are kept, entries whose widget is gone are
+ * reused for new widgets of the same type and label, and only the rest is
+ * deleted or built. The consumer therefore sees one layout update for the
+ * parent, and none at all when a submenu was rebuilt with the same entries.
+ */
+static void menu_node_shell_reconcile(MenuNodeShell *node_shell)
+{
+	MenuNode *node         = node_shell->node;
+	GPtrArray *old_entries = node_shell->entries;
+	GPtrArray *entries;
+	GPtrArray *widgets;
+	GHashTable *unused;
+	GList *children;
+	MenuEntry **matched;
+	guint offset;
+
+	node_shell->dirty = false;
+
+	if (!node->populated || node_shell->shell == NULL)
+		return;
+
+	menu_node_shell_flush_pending(node_shell);
+
+	children = gtk_container_get_children(GTK_CONTAINER(node_shell->shell));
+	widgets  = g_ptr_array_new();
+	unused   = g_hash_table_new(NULL, NULL);
+
+	for (GList *iter = children; iter != NULL; iter = g_list_next(iter))
+		if (GTK_IS_MENU_ITEM(iter->data))
+			g_ptr_array_add(widgets, iter->data);
+
+	g_list_free(children);
+
+	for (guint i = 0; i < old_entries->len; i++)
+	{
+		MenuEntry *entry = old_entries->pdata[i];
+
+		g_hash_table_insert(unused, entry->widget, entry);
+	}
+
+	matched = g_new0(MenuEntry *, widgets->len);
+
+	/* Widgets that are still there keep their entry */
+	for (guint i = 0; i < widgets->len; i++)
+	{
+		matched[i] = g_hash_table_lookup(unused, widgets->pdata[i]);
+
+		if (matched[i] != NULL)
+			g_hash_table_remove(unused, widgets->pdata[i]);
+	}
+
+	/* New widgets take over entries of removed widgets with the same label */
+	for (guint i = 0; i < widgets->len; i++)
+	{
+		if (matched[i] != NULL)
+			continue;
+
+		for (guint j = 0; j < old_entries->len; j++)
+		{
+			MenuEntry *entry  = old_entries->pdata[j];
+			GtkWidget *widget = entry->widget;
+
+			if (g_hash_table_contains(unused, widget) &&
+			    menu_entry_matches(entry, widgets->pdata[i]) &&
+			    menu_entry_rebind(entry, widgets->pdata[i]))
+			{
+				g_hash_table_remove(unused, widget);
+				gtk_widget_fix_menu_icons(widgets->pdata[i]);
+				matched[i] = entry;
+				break;
+			}
+		}
+	}
+
+	/* Entries that were neither kept nor reused go away */
+	g_ptr_array_set_free_func(old_entries, NULL);
+
+	for (guint i = 0; i < old_entries->len; i++)
+	{
+		MenuEntry *entry = old_entries->pdata[i];
+		MenuNode *child;
+
+		if (g_hash_table_lookup(unused, entry->widget) != entry)
+			continue;
+
+		child = g_object_get_data(G_OBJECT(entry->item), MENU_NODE);
+
+		if (child != NULL)
+			menu_node_unpopulate(child);
+
+		dbusmenu_menuitem_child_delete(node->item, entry->item);
+		menu_entry_free(entry);
+	}
+
+	g_hash_table_unref(unused);
+
+	offset              = menu_node_shell_get_offset(node_shell);
+	entries             = g_ptr_array_new_full(widgets->len, menu_entry_free);
+	node_shell->entries = entries;
+
+	for (guint i = 0; i < widgets->len; i++)
+	{
+		GtkWidget *widget = widgets->pdata[i];
+		guint position    = offset + entries->len;
+
+		if (matched[i] == NULL)
+		{
+			DbusmenuMenuitem *item;
+
+			populate_depth++;
+			item = menu_node_build_item(node, widget);
+			populate_depth--;
+
+			if (item == NULL)
+				continue;
+
+			dbusmenu_menuitem_child_add_position(node->item, item, position);
+			g_ptr_array_add(entries, menu_entry_new(widget, item));
+			gtk_widget_fix_menu_icons(widget);
+		}
+		else
+		{
+			if (dbusmenu_menuitem_get_position(matched[i]->item, node->item) != position)
+				dbusmenu_menuitem_child_reorder(node->item, matched[i]->item, position);
+
+			g_ptr_array_add(entries, matched[i]);
+		}
+	}
+
+	g_ptr_array_unref(old_entries);
+	g_ptr_array_unref(widgets);
+	g_free(matched);
+}
+
+static gboolean menu_tree_reconcile_idle(gpointer user_data)
+{
+	MenuNodeShell *node_shell;
+
+	reconcile_source_id = 0;
+
+	while ((node_shell = g_queue_pop_head(&reconcile_queue)) != NULL)
+		menu_node_shell_reconcile(node_shell);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void menu_node_shell_schedule_reconcile(MenuNodeShell *node_shell)
+{
+	if (node_shell->dirty)
+		return;
+
+	node_shell->dirty = true;
+	g_queue_push_tail(&reconcile_queue, node_shell);
+
+	if (reconcile_source_id != 0)
+		return;
+
+	/* Shell changes are batched over the same window as property changes */
+	if (batch_get_window_ms() > 0)
+		reconcile_source_id =
+		    g_timeout_add(batch_get_window_ms(), menu_tree_reconcile_idle, NULL);
+	else
+		reconcile_source_id =
+		    g_idle_add_full(G_PRIORITY_HIGH_IDLE, menu_tree_reconcile_idle, NULL, NULL);
+}
+
+static void menu_node_shell_cancel_reconcile(MenuNodeShell *node_shell)
+{
+	if (node_shell->dirty)
+		g_queue_remove(&reconcile_queue, node_shell);
+
+	node_shell->dirty = false;
+}
+
+static void on_shell_insert(GtkMenuShell *menu_shell, GtkWidget *child, gint position,
+                            gpointer user_data)
+{
+	if (GTK_IS_MENU_ITEM(child))
+	{
+		batch_note_layout_change();
+		menu_node_shell_schedule_reconcile(user_data);
+	}
+}
+
+static void on_shell_remove(GtkContainer *container, GtkWidget *widget, gpointer user_data)
+{
+	MenuNodeShell *node_shell = user_data;
+	GList *link               = g_list_find(node_shell->pending, widget);
+
+	/* A queued widget that is gone does not need to be built */
+	if (link != NULL)
+	{
+		node_shell->pending = g_list_delete_link(node_shell->pending, link);
+		g_object_unref(widget);
+	}
+
+	if (GTK_IS_MENU_ITEM(widget))
+	{
+		batch_note_layout_change();
+		menu_node_shell_schedule_reconcile(node_shell);
+	}
+}
+
+static void menu_node_shell_populate(MenuNodeShell *node_shell)
+{
+	GList *children = gtk_container_get_children(GTK_CONTAINER(node_shell->shell));
+	MenuNode *node  = node_shell->node;
+
+	if (node != node->root && !menu_tree_is_lazy() && menu_tree_get_slice_ms() > 0)
+	{
+		menu_node_shell_queue(node_shell, children);
+		g_list_free(children);
+		children = NULL;
+	}
+
+	for (GList *iter = children; iter != NULL; iter = g_list_next(iter))
+	{
+		DbusmenuMenuitem *item;
+
+		if (!GTK_IS_MENU_ITEM(iter->data))
+			continue;
+
+		item = menu_node_build_item(node, iter->data);
+
+		if (item != NULL)
+			menu_node_shell_append(node_shell, iter->data, item);
+	}
+
+	g_list_free(children);
+
+	node_shell->insert_handler_id = g_signal_connect_after(node_shell->shell,
+	                                                       "insert",
+	                                                       G_CALLBACK(on_shell_insert),
+	                                                       node_shell);
+	node_shell->remove_handler_id = g_signal_connect_after(node_shell->shell,
+	                                                       "remove",
+	                                                       G_CALLBACK(on_shell_remove),
+	                                                       node_shell);
+}
+
+static void menu_tree_drop_cached_item(GtkWidget *widget, gpointer user_data)
+{
+	/* Lets libdbusmenu-gtk free the leaves of a subtree we no longer export */
+	if (GTK_IS_MENU_ITEM(widget) &&
+	    g_object_get_qdata(G_OBJECT(widget), appmenu_gtk_wayland_menu_item_quark()) == NULL)
+		g_object_set_data(G_OBJECT(widget), PARSER_CACHED_ITEM, NULL);
+}
+
+static void menu_node_shell_disconnect(MenuNodeShell *node_shell)
+{
+	if (node_shell->shell != NULL)
+	{
+		if (node_shell->insert_handler_id != 0)
+			g_signal_handler_disconnect(node_shell->shell, node_shell->insert_handler_id);
+
+		if (node_shell->remove_handler_id != 0)
+			g_signal_handler_disconnect(node_shell->shell, node_shell->remove_handler_id);
+	}
+
+	node_shell->insert_handler_id = 0;
+	node_shell->remove_handler_id = 0;
+}
+
+/* Removes the children node_shell contributed to its node */
+static void menu_node_shell_unpopulate(MenuNodeShell *node_shell)
+{
+	MenuNode *node = node_shell->node;
+
+	menu_node_shell_cancel_pending(node_shell);
+	menu_node_shell_cancel_reconcile(node_shell);
+	menu_node_shell_disconnect(node_shell);
+
+	for (guint i = 0; i < node_shell->entries->len; i++)
+	{
+		MenuEntry *entry = node_shell->entries->pdata[i];
+		MenuNode *child  = g_object_get_data(G_OBJECT(entry->item), MENU_NODE);
+
+		if (child != NULL)
+			menu_node_unpopulate(child);
+
+		dbusmenu_menuitem_child_delete(node->item, entry->item);
+	}
+
+	g_ptr_array_set_size(node_shell->entries, 0);
+
+	if (node_shell->shell != NULL)
+		gtk_container_forall(GTK_CONTAINER(node_shell->shell), menu_tree_drop_cached_item, NULL);
+}
+
+static MenuNodeShell *menu_node_add_shell(MenuNode *node, GtkWidget *shell)
+{
+	MenuNodeShell *node_shell = g_slice_new0(MenuNodeShell);
+
+	node_shell->node    = node;
+	node_shell->shell   = shell;
+	node_shell->entries = g_ptr_array_new_with_free_func(menu_entry_free);
+	g_object_add_weak_pointer(G_OBJECT(shell), (gpointer *)&node_shell->shell);
+	node->shells = g_slist_append(node->shells, node_shell);
+
+	if (node->populated)
+		menu_node_shell_populate(node_shell);
+
+	return node_shell;
+}
+
+static void menu_node_remove_shell(MenuNode *node, MenuNodeShell *node_shell)
+{
+	if (node->populated)
+		menu_node_shell_unpopulate(node_shell);
+	else
+		menu_node_shell_disconnect(node_shell);
+
+	menu_node_shell_cancel_pending(node_shell);
+	menu_node_shell_cancel_reconcile(node_shell);
+	node->shells = g_slist_remove(node->shells, node_shell);
+
+	if (node_shell->shell != NULL)
+		g_object_remove_weak_pointer(G_OBJECT(node_shell->shell), (gpointer *)&node_shell->shell);
+
+	g_ptr_array_unref(node_shell->entries);
+	g_slice_free(MenuNodeShell, node_shell);
+}
+
+static void menu_node_fix_icons(MenuNode *node)
+{
+	for (GSList *iter = node->shells; iter != NULL; iter = iter->next)
+	{
+		MenuNodeShell *node_shell = iter->data;
+
+		if (node_shell->shell != NULL)
+			gtk_widget_fix_menu_icons(node_shell->shell);
+	}
+}
+
+static void menu_node_populate(MenuNode *node)
+{
+	if (node->populated)
+		return;
+
+	node->populated = true;
+	populate_depth++;
+
+	for (GSList *iter = node->shells; iter != NULL; iter = iter->next)
+		if (((MenuNodeShell *)iter->data)->shell != NULL)
+			menu_node_shell_populate(iter->data);
+
+	populate_depth--;
+
+	if (populate_depth == 0)
+		menu_node_fix_icons(node);
+}
+
+static void menu_node_unpopulate(MenuNode *node)
+{
+	if (!node->populated)
+		return;
+
+	node->populated = false;
+
+	for (GSList *iter = node->shells; iter != NULL; iter = iter->next)
+		menu_node_shell_unpopulate(iter->data);
+}
+
+static void menu_node_set_shell(MenuNode *node, GtkWidget *shell)
+{
+	menu_node_unpopulate(node);
+
+	while (node->shells != NULL)
+		menu_node_remove_shell(node, node->shells->data);
+
+	if (shell != NULL)
+		menu_node_add_shell(node, shell);
+}
+
+static void menu_node_cancel_expire(MenuNode *node)
+{
+	if (node->expire_source_id != 0)
+	{
+		g_source_remove(node->expire_source_id);
+		node->expire_source_id = 0;
+	}
+}
+
+static gboolean menu_node_expire(gpointer user_data)
+{
+	MenuNode *node = user_data;
+
+	g_debug("menu_node_expire: dropping unused subtree of %p", node->widget);
+	node->expire_source_id = 0;
+	menu_node_unpopulate(node);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void menu_node_schedule_expire(MenuNode *node)
+{
+	guint seconds = module_env_get_uint(LAZY_EXPIRE_ENV, LAZY_EXPIRE_DEFAULT);
+
+	menu_node_cancel_expire(node);
+
+	if (menu_tree_is_lazy() && seconds > 0 && node->widget != NULL && node->populated)
+		node->expire_source_id = g_timeout_add_seconds(seconds, menu_node_expire, node);
+}
+
+/* Builds and applies whatever node still has queued, for a consumer about to read it */
+static void menu_node_settle(MenuNode *node)
+{
+	for (GSList *iter = node->shells; iter != NULL; iter = iter->next)
+	{
+		MenuNodeShell *node_shell = iter->data;
+
+		menu_node_shell_flush_pending(node_shell);
+
+		if (node_shell->dirty)
+		{
+			menu_node_shell_cancel_reconcile(node_shell);
+			menu_node_shell_reconcile(node_shell);
+		}
+	}
+}
+
+static void menu_node_show(MenuNode *node)
+{
+	menu_node_cancel_expire(node);
+
+	/* Give the application the same chance to update the submenu that it
+	 * gets when the menu is opened inside the window, every time, like
+	 * libdbusmenu-gtk does. */
+	if (node->widget != NULL)
+		gtk_menu_item_activate(GTK_MENU_ITEM(node->widget));
+
+	if (!node->populated)
+	{
+		g_debug("menu_node_show: parsing subtree of %p", node->widget);
+		menu_node_populate(node);
+	}
+	else
+	{
+		menu_node_settle(node);
+	}
+}
+
+/*
+ * Makes the children of item complete before its layout is sent, for a
+ * consumer that calls GetLayout without AboutToShow. The submenu is not
+ * activated, the consumer has not opened it.
+ */
+G_GNUC_INTERNAL void menu_tree_prepare_layout(DbusmenuMenuitem *item)
+{
+	MenuNode *node = g_object_get_data(G_OBJECT(item), MENU_NODE);
+
+	if (node == NULL)
+		return;
+
+	if (!node->populated)
+	{
+		g_debug("menu_tree_prepare_layout: parsing subtree of %p", node->widget);
+		menu_node_populate(node);
+		menu_node_schedule_expire(node);
+	}
+	else
+	{
+		menu_node_settle(node);
+	}
+}
+
+/* The submenu node mirrors, i.e. the GtkMenu the consumer shows in its place */
+static GtkWidget *menu_node_get_submenu(MenuNode *node)
+{
+	return node->shells != NULL ? ((MenuNodeShell *)node->shells->data)->shell : NULL;
+}
+
+static gboolean on_node_about_to_show(DbusmenuMenuitem *item, gpointer user_data)
+{
+	menu_node_show(user_data);
+
+	return TRUE;
+}
+
+static gboolean on_node_event(DbusmenuMenuitem *item, const char *name, GVariant *value,
+                              guint timestamp, gpointer user_data)
+{
+	MenuNode *node     = user_data;
+	GtkWidget *submenu = menu_node_get_submenu(node);
+
+	if (g_strcmp0(name, DBUSMENU_MENUITEM_EVENT_OPENED) == 0)
+	{
+		/* AboutToShow already activated the item if the consumer sent it */
+		if (!node->populated)
+			menu_node_show(node);
+		else
+			menu_node_cancel_expire(node);
+
+		/* Lets "show" handlers of the application and ours in icons.c run */
+		if (submenu != NULL)
+			gtk_widget_show(submenu);
+
+		menu_node_settle(node);
+	}
+	else if (g_strcmp0(name, DBUSMENU_MENUITEM_EVENT_CLOSED) == 0)
+	{
+		if (submenu != NULL)
+			gtk_widget_hide(submenu);
+
+		menu_node_schedule_expire(node);
+	}
+
+	return FALSE;
+}
+
+static void on_node_widget_notify(GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+	MenuNode *node = g_object_get_data(G_OBJECT(user_data), MENU_NODE);
+
+	if (node != NULL)
+		menu_node_sync(node);
+}
+
+static void on_node_submenu_notify(GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+	MenuNode *node = g_object_get_data(G_OBJECT(user_data), MENU_NODE);
+	GtkWidget *submenu;
+	GtkWidget *shell;
+
+	if (node == NULL || node->widget == NULL)
+		return;
+
+	submenu = gtk_menu_item_get_submenu(GTK_MENU_ITEM(node->widget));
+	shell   = menu_node_get_submenu(node);
+
+	if (submenu != shell)
+	{
+		menu_node_set_shell(node, submenu);
+		menu_node_sync(node);
+
+		if (!menu_tree_is_lazy())
+			menu_node_populate(node);
+	}
+}
+
+static void menu_node_free(gpointer data)
+{
+	MenuNode *node = data;
+
+	menu_node_cancel_expire(node);
+
+	while (node->shells != NULL)
+	{
+		MenuNodeShell *node_shell = node->shells->data;
+
+		menu_node_shell_cancel_pending(node_shell);
+		menu_node_shell_cancel_reconcile(node_shell);
+		menu_node_shell_disconnect(node_shell);
+		node->shells = g_slist_delete_link(node->shells, node->shells);
+
+		if (node_shell->shell != NULL)
+			g_object_remove_weak_pointer(G_OBJECT(node_shell->shell),
+			                             (gpointer *)&node_shell->shell);
+
+		g_ptr_array_unref(node_shell->entries);
+		g_slice_free(MenuNodeShell, node_shell);
+	}
+
+	if (node->widget != NULL)
+	{
+		GObject *widget = G_OBJECT(node->widget);
+
+		if (g_object_get_qdata(widget, appmenu_gtk_wayland_menu_item_quark()) == node->item)
+			g_object_set_qdata(widget, appmenu_gtk_wayland_menu_item_quark(), NULL);
+
+		g_object_remove_weak_pointer(widget, (gpointer *)&node->widget);
+	}
+
+	g_slice_free(MenuNode, node);
+}
+
+/* Makes widget the menu item that node mirrors */
+static void menu_node_bind_widget(MenuNode *node, GtkWidget *widget)
+{
+	DbusmenuMenuitem *item = node->item;
+	GtkWidget *label;
+
+	if (node->widget != NULL)
+	{
+		GObject *old_widget  = G_OBJECT(node->widget);
+		GtkWidget *old_label = gtk_bin_get_child(GTK_BIN(old_widget));
+
+		g_signal_handlers_disconnect_by_data(old_widget, item);
+
+		if (old_label != NULL)
+			g_signal_handlers_disconnect_by_data(old_label, item);
+
+		if (g_object_get_qdata(old_widget, appmenu_gtk_wayland_menu_item_quark()) == item)
+			g_object_set_qdata(old_widget, appmenu_gtk_wayland_menu_item_quark(), NULL);
+
+		g_object_remove_weak_pointer(old_widget, (gpointer *)&node->widget);
+	}
+
+	label        = gtk_bin_get_child(GTK_BIN(widget));
+	node->widget = widget;
+	g_object_add_weak_pointer(G_OBJECT(widget), (gpointer *)&node->widget);
+	g_object_set_qdata(G_OBJECT(widget), appmenu_gtk_wayland_menu_item_quark(), item);
+
+	g_signal_connect_object(widget,
+	                        "notify::label",
+	                        G_CALLBACK(on_node_widget_notify),
+	                        item,
+	                        0);
+	g_signal_connect_object(widget,
+	                        "notify::sensitive",
+	                        G_CALLBACK(on_node_widget_notify),
+	                        item,
+	                        0);
+	g_signal_connect_object(widget,
+	                        "notify::visible",
+	                        G_CALLBACK(on_node_widget_notify),
+	                        item,
+	                        0);
+	g_signal_connect_object(widget,
+	                        "notify::submenu",
+	                        G_CALLBACK(on_node_submenu_notify),
+	                        item,
+	                        0);
+
+	if (GTK_IS_LABEL(label))
+		g_signal_connect_object(label,
+		                        "notify::label",
+		                        G_CALLBACK(on_node_widget_notify),
+		                        item,
+		                        0);
+}
+
+static MenuNode *menu_node_new(MenuNode *root, DbusmenuMenuitem *item, GtkWidget *widget,
+                               GtkWidget *shell)
+{
+	MenuNode *node = g_slice_new0(MenuNode);
+
+	node->root = root != NULL ? root : node;
+	node->item = item;
+	g_object_set_data_full(G_OBJECT(item), MENU_NODE, node, menu_node_free);
+	if (widget != NULL)
+	{
+		menu_node_bind_widget(node, widget);
+
+		g_signal_connect(item,
+		                 DBUSMENU_MENUITEM_SIGNAL_ABOUT_TO_SHOW,
+		                 G_CALLBACK(on_node_about_to_show),
+		                 node);
+		g_signal_connect(item, DBUSMENU_MENUITEM_SIGNAL_EVENT, G_CALLBACK(on_node_event), node);
+	}
+
+	if (shell != NULL)
+		menu_node_add_shell(node, shell);
+
+	menu_node_sync(node);
+
+	return node;
+}
+
+static DbusmenuMenuitem *menu_node_build_item(MenuNode *parent, GtkWidget *widget)
+{
+	GtkWidget *submenu = gtk_menu_item_get_submenu(GTK_MENU_ITEM(widget));
+	DbusmenuMenuitem *item;
+	MenuNode *node;
+
+	if (submenu == NULL)
+	{
+		item = dbusmenu_gtk_parse_menu_structure(widget);
+
+		if (item != NULL)
+			menu_tree_track_item(item);
+
+		return item;
+	}
+
+	item = dbusmenu_menuitem_new();
+	menu_tree_track_item(item);
+	node = menu_node_new(parent->root, item, widget, submenu);
+
+	if (!menu_tree_is_lazy())
+		menu_node_populate(node);
+
+	return item;
+}
+
+/*
+ * Returns a new, empty root item that menu shells can be attached to.
+ * complete_func is called whenever no part of the tree is left to build.
+ */
+G_GNUC_INTERNAL DbusmenuMenuitem *menu_tree_new(MenuTreeCompleteFunc complete_func,
+                                                gpointer user_data)
+{
+	DbusmenuMenuitem *root = dbusmenu_menuitem_new();
+	MenuNode *node;
+
+	menu_tree_track_item(root);
+	node = menu_node_new(NULL, root, NULL, NULL);
+
+	/* Top level items are always exported */
+	node->populated     = true;
+	node->complete_func = complete_func;
+	node->complete_data = user_data;
+
+	return root;
+}
+
+/* Appends the items of menu_shell to the children of root */
+G_GNUC_INTERNAL void menu_tree_attach_shell(DbusmenuMenuitem *root, GtkMenuShell *menu_shell)
+{
+	MenuNode *node = g_object_get_data(G_OBJECT(root), MENU_NODE);
+
+	g_return_if_fail(node != NULL);
+
+	populate_depth++;
+	menu_node_add_shell(node, GTK_WIDGET(menu_shell));
+	populate_depth--;
+
+	gtk_widget_fix_menu_icons(GTK_WIDGET(menu_shell));
+	menu_tree_check_complete(node);
+}
+
+/* Removes the items of menu_shell from the children of root */
+G_GNUC_INTERNAL void menu_tree_detach_shell(DbusmenuMenuitem *root, GtkMenuShell *menu_shell)
+{
+	MenuNode *node = g_object_get_data(G_OBJECT(root), MENU_NODE);
+
+	g_return_if_fail(node != NULL);
+
+	for (GSList *iter = node->shells; iter != NULL; iter = iter->next)
+	{
+		MenuNodeShell *node_shell = iter->data;
+
+		if (node_shell->shell == GTK_WIDGET(menu_shell))
+		{
+			menu_node_remove_shell(node, node_shell);
+			break;
+		}
+	}
+}
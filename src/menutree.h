@@ -0,0 +1,42 @@
+/*
+ * appmenu-gtk-module
+ * Copyright 2012 Canonical Ltd.
+ * Copyright (C) 2015-2017 Konstantin Pugin <ria.freelander@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: Ryan Lortie <desrt@desrt.ca>
+ *          William Hua <william.hua@canonical.com>
+ *          Konstantin Pugin <ria.freelander@gmail.com>
+ *          Lester Carballo Perez <lestcape@gmail.com>
+ */
+
+#ifndef MENUTREE_H
+#define MENUTREE_H
+
+#include <gtk/gtk.h>
+#include <libdbusmenu-glib/menuitem.h>
+#include <stdbool.h>
+
+typedef void (*MenuTreeCompleteFunc)(gpointer user_data);
+
+G_GNUC_INTERNAL bool menu_tree_is_lazy(void);
+G_GNUC_INTERNAL DbusmenuMenuitem *menu_tree_new(MenuTreeCompleteFunc complete_func,
+                                                gpointer user_data);
+G_GNUC_INTERNAL void menu_tree_attach_shell(DbusmenuMenuitem *root, GtkMenuShell *menu_shell);
+G_GNUC_INTERNAL void menu_tree_detach_shell(DbusmenuMenuitem *root, GtkMenuShell *menu_shell);
+G_GNUC_INTERNAL DbusmenuMenuitem *menu_tree_lookup_item(GtkWidget *widget);
+G_GNUC_INTERNAL void menu_tree_prepare_layout(DbusmenuMenuitem *item);
+
+#endif // MENUTREE_H
@@ -29,113 +29,221 @@
 #include "support.h"
 
 #ifdef GDK_WINDOWING_X11
-G_GNUC_INTERNAL char *gtk_widget_get_x11_property_string(GtkWidget *widget, const char *name)
+#include <X11/Xlib-xcb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcb.h>
+
+static xcb_atom_t gdk_display_get_xcb_atom(GdkDisplay *display, const char *name)
+{
+	Atom atom = None;
+
+	if (display != NULL)
+		atom = gdk_x11_get_xatom_by_name_for_display(display, name);
+
+	if (atom == None)
+		atom = gdk_x11_get_xatom_by_name(name);
+
+	return atom;
+}
+
+/*
+ * Reads the string properties names of the window of widget into values, or
+ * NULL for unset ones. All requests are sent before the first reply is
+ * waited for, so the properties cost one round trip together.
+ */
+static void gtk_widget_get_x11_property_strings(GtkWidget *widget, const char *const *names,
+                                                char **values, guint n_names)
 {
+	xcb_atom_t *properties;
+	xcb_get_property_cookie_t *cookies;
 	GdkWindow *window;
 	GdkDisplay *display;
-	Display *xdisplay;
-	Window xwindow;
-	Atom property;
-	Atom actual_type;
-	int actual_format;
-	unsigned long nitems;
-	unsigned long bytes_after;
-	unsigned char *prop;
+	xcb_connection_t *connection;
+	xcb_window_t xwindow;
 
-	g_return_val_if_fail(GTK_IS_WIDGET(widget), NULL);
+	for (guint i = 0; i < n_names; i++)
+		values[i] = NULL;
 
-	window   = gtk_widget_get_window(widget);
-	display  = gdk_window_get_display(window);
-	xdisplay = GDK_DISPLAY_XDISPLAY(display);
-	xwindow  = GDK_WINDOW_XID(window);
+	g_return_if_fail(GTK_IS_WIDGET(widget));
 
-	property = None;
+	window     = gtk_widget_get_window(widget);
+	display    = gdk_window_get_display(window);
+	connection = XGetXCBConnection(GDK_DISPLAY_XDISPLAY(display));
+	xwindow    = GDK_WINDOW_XID(window);
+	properties = g_new(xcb_atom_t, n_names);
+	cookies    = g_new(xcb_get_property_cookie_t, n_names);
 
-	if (display != NULL)
-		property = gdk_x11_get_xatom_by_name_for_display(display, name);
-
-	if (property == None)
-		property = gdk_x11_get_xatom_by_name(name);
-
-	g_return_val_if_fail(property != None, NULL);
-
-	if (XGetWindowProperty(xdisplay,
-	                       xwindow,
-	                       property,
-	                       0,
-	                       G_MAXLONG,
-	                       False,
-	                       AnyPropertyType,
-	                       &actual_type,
-	                       &actual_format,
-	                       &nitems,
-	                       &bytes_after,
-	                       &prop) == Success)
+	for (guint i = 0; i < n_names; i++)
 	{
-		if (actual_format)
+		properties[i] = gdk_display_get_xcb_atom(display, names[i]);
+
+		if (properties[i] == XCB_ATOM_NONE)
 		{
-			char *string = g_strdup((const char *)prop);
+			g_warning("no atom for %s", names[i]);
+			goto out;
+		}
+	}
 
-			if (prop != NULL)
-				XFree(prop);
+	for (guint i = 0; i < n_names; i++)
+		cookies[i] = xcb_get_property(connection,
+		                              FALSE,
+		                              xwindow,
+		                              properties[i],
+		                              XCB_GET_PROPERTY_TYPE_ANY,
+		                              0,
+		                              G_MAXUINT32 / 4);
 
-			return string;
-		}
-		else
-			return NULL;
+	for (guint i = 0; i < n_names; i++)
+	{
+		xcb_get_property_reply_t *reply = xcb_get_property_reply(connection, cookies[i], NULL);
+
+		if (reply != NULL && reply->format != 0)
+			values[i] = g_strndup(xcb_get_property_value(reply),
+			                      xcb_get_property_value_length(reply));
+
+		free(reply);
 	}
 
-	return NULL;
+out:
+	g_free(cookies);
+	g_free(properties);
 }
 
-G_GNUC_INTERNAL void gtk_widget_set_x11_property_string(GtkWidget *widget, const char *name,
-                                                        const char *value)
+/*
+ * Sets the string properties names of the window of widget to values and
+ * deletes those with a NULL value. The requests are flushed together and
+ * need no reply.
+ */
+static void gtk_widget_set_x11_property_strings(GtkWidget *widget, const char *const *names,
+                                                const char *const *values, guint n_names)
 {
 	GdkWindow *window;
 	GdkDisplay *display;
-	Display *xdisplay;
-	Window xwindow;
-	Atom property;
-	Atom type;
+	xcb_connection_t *connection;
+	xcb_window_t xwindow;
+	xcb_atom_t *properties;
+	xcb_atom_t type;
 
 	g_return_if_fail(GTK_IS_WIDGET(widget));
 
-	window   = gtk_widget_get_window(widget);
-	display  = gdk_window_get_display(window);
-	xdisplay = GDK_DISPLAY_XDISPLAY(display);
-	xwindow  = GDK_WINDOW_XID(window);
+	window     = gtk_widget_get_window(widget);
+	display    = gdk_window_get_display(window);
+	connection = XGetXCBConnection(GDK_DISPLAY_XDISPLAY(display));
+	xwindow    = GDK_WINDOW_XID(window);
+	type       = gdk_display_get_xcb_atom(display, "UTF8_STRING");
 
-	property = None;
+	g_return_if_fail(type != XCB_ATOM_NONE);
 
-	if (display != NULL)
-		property = gdk_x11_get_xatom_by_name_for_display(display, name);
+	/* Every atom is resolved first, so a failure leaves the window untouched
+	 * instead of half updated */
+	properties = g_new(xcb_atom_t, n_names);
 
-	if (property == None)
-		property = gdk_x11_get_xatom_by_name(name);
+	for (guint i = 0; i < n_names; i++)
+	{
+		properties[i] = gdk_display_get_xcb_atom(display, names[i]);
+
+		if (properties[i] == XCB_ATOM_NONE)
+		{
+			g_warning("no atom for %s", names[i]);
+			goto out;
+		}
+	}
 
-	g_return_if_fail(property != None);
+	for (guint i = 0; i < n_names; i++)
+	{
+		if (values[i] != NULL)
+			xcb_change_property(connection,
+			                    XCB_PROP_MODE_REPLACE,
+			                    xwindow,
+			                    properties[i],
+			                    type,
+			                    8,
+			                    strlen(values[i]),
+			                    values[i]);
+		else
+			xcb_delete_property(connection, xwindow, properties[i]);
+	}
 
-	type = None;
+	xcb_flush(connection);
 
-	if (display != NULL)
-		type = gdk_x11_get_xatom_by_name_for_display(display, "UTF8_STRING");
-
-	if (type == None)
-		type = gdk_x11_get_xatom_by_name("UTF8_STRING");
-
-	g_return_if_fail(type != None);
-
-	if (value != NULL)
-		XChangeProperty(xdisplay,
-		                xwindow,
-		                property,
-		                type,
-		                8,
-		                PropModeReplace,
-		                (unsigned char *)value,
-		                g_utf8_strlen(value, -1));
-	else
-		XDeleteProperty(xdisplay, xwindow, property);
+out:
+	g_free(properties);
+}
+
+static void gtk_x11_window_export_properties(GObject *object, GDBusConnection *session)
+{
+	GtkWindow *window = GTK_WINDOW(object);
+	WindowData *window_data;
+
+	window_data = g_object_get_qdata(object, appmenu_gtk_wayland_window_data_quark());
+
+	if (window_data == NULL || !gtk_widget_get_realized(GTK_WIDGET(window)))
+		return;
+
+	static const char *const names[] = { _GTK_UNIQUE_BUS_NAME,
+	                                     _UNITY_OBJECT_PATH,
+	                                     _GTK_MENUBAR_OBJECT_PATH };
+	char *object_path = g_strdup_printf(OBJECT_PATH "/%d", window_data->window_id);
+	char *old_values[G_N_ELEMENTS(names)];
+	GDBusActionGroup *old_action_group = NULL;
+	GDBusMenuModel *old_menu_model     = NULL;
+	guint n_new                        = 0;
+	const char *new_names[G_N_ELEMENTS(names)];
+	const char *new_values[G_N_ELEMENTS(names)];
+
+	gtk_widget_get_x11_property_strings(GTK_WIDGET(window),
+	                                    names,
+	                                    old_values,
+	                                    G_N_ELEMENTS(names));
+
+	char *old_unique_bus_name     = old_values[0];
+	char *old_unity_object_path   = old_values[1];
+	char *old_menubar_object_path = old_values[2];
+
+	if (old_unique_bus_name != NULL)
+	{
+		if (old_unity_object_path != NULL)
+			old_action_group = g_dbus_action_group_get(session,
+			                                           old_unique_bus_name,
+			                                           old_unity_object_path);
+
+		if (old_menubar_object_path != NULL)
+			old_menu_model = g_dbus_menu_model_get(session,
+			                                       old_unique_bus_name,
+			                                       old_menubar_object_path);
+	}
+
+	if (old_menu_model != NULL)
+	{
+		window_data->old_model = G_MENU_MODEL(g_object_ref(old_menu_model));
+		g_menu_append_section(window_data->menu_model, NULL, G_MENU_MODEL(old_menu_model));
+	}
+
+	/* Properties another toolkit already set are left alone */
+	for (guint i = 0; i < G_N_ELEMENTS(names); i++)
+	{
+		if (old_values[i] != NULL)
+			continue;
+
+		new_names[n_new]  = names[i];
+		new_values[n_new] = i == 0 ? g_dbus_connection_get_unique_name(session) : object_path;
+		n_new++;
+	}
+
+	if (n_new > 0)
+		gtk_widget_set_x11_property_strings(GTK_WIDGET(window), new_names, new_values, n_new);
+
+	g_free(old_menubar_object_path);
+	g_free(old_unity_object_path);
+	g_free(old_unique_bus_name);
+	g_free(object_path);
+
+	if (old_menu_model != NULL)
+		g_object_unref(old_menu_model);
+
+	if (old_action_group != NULL)
+		g_object_unref(old_action_group);
 }
 
 G_GNUC_INTERNAL WindowData *gtk_x11_window_get_window_data(GtkWindow *window)
@@ -151,80 +259,18 @@ G_GNUC_INTERNAL WindowData *gtk_x11_window_get_window_data(GtkWindow *window)
 	{
 		static guint window_id;
 
-		GDBusConnection *session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
-		if (session == NULL)
-			return NULL;
-
-		char *object_path        = g_strdup_printf(OBJECT_PATH "/%d", window_id);
-		char *old_unique_bus_name =
-		    gtk_widget_get_x11_property_string(GTK_WIDGET(window), _GTK_UNIQUE_BUS_NAME);
-		char *old_unity_object_path =
-		    gtk_widget_get_x11_property_string(GTK_WIDGET(window), _UNITY_OBJECT_PATH);
-		char *old_menubar_object_path =
-		    gtk_widget_get_x11_property_string(GTK_WIDGET(window),
-		                                       _GTK_MENUBAR_OBJECT_PATH);
-		GDBusActionGroup *old_action_group = NULL;
-		GDBusMenuModel *old_menu_model     = NULL;
-
-		if (old_unique_bus_name != NULL)
-		{
-			if (old_unity_object_path != NULL)
-				old_action_group = g_dbus_action_group_get(session,
-				                                           old_unique_bus_name,
-				                                           old_unity_object_path);
-
-			if (old_menubar_object_path != NULL)
-				old_menu_model = g_dbus_menu_model_get(session,
-				                                       old_unique_bus_name,
-				                                       old_menubar_object_path);
-		}
-
 		window_data             = window_data_new();
 		window_data->window_id  = window_id++;
 		window_data->menu_model = g_menu_new();
 
-		if (old_menu_model != NULL)
-		{
-			window_data->old_model = G_MENU_MODEL(g_object_ref(old_menu_model));
-			g_menu_append_section(window_data->menu_model,
-			                      NULL,
-			                      G_MENU_MODEL(old_menu_model));
-		}
-
-		if (old_unique_bus_name == NULL)
-			gtk_widget_set_x11_property_string(GTK_WIDGET(window),
-			                                   _GTK_UNIQUE_BUS_NAME,
-			                                   g_dbus_connection_get_unique_name(
-			                                       session));
-
-		if (old_unity_object_path == NULL)
-			gtk_widget_set_x11_property_string(GTK_WIDGET(window),
-			                                   _UNITY_OBJECT_PATH,
-			                                   object_path);
-
-		if (old_menubar_object_path == NULL)
-			gtk_widget_set_x11_property_string(GTK_WIDGET(window),
-			                                   _GTK_MENUBAR_OBJECT_PATH,
-			                                   object_path);
-
 		g_object_set_qdata_full(G_OBJECT(window),
 		                        appmenu_gtk_wayland_window_data_quark(),
 		                        window_data,
 		                        window_data_free);
 
-		g_free(old_menubar_object_path);
-		g_free(old_unity_object_path);
-		g_free(old_unique_bus_name);
-		g_free(object_path);
-
-		if (old_menu_model != NULL)
-			g_object_unref(old_menu_model);
-
-		if (old_action_group != NULL)
-			g_object_unref(old_action_group);
-
-		if (session != NULL)
-			g_object_unref(session);
+		/* The properties carry our unique name, so they are written once the
+		 * shared session bus connection is available. */
+		session_bus_when_ready(G_OBJECT(window), gtk_x11_window_export_properties);
 	}
 
 	return window_data;
@@ -239,16 +285,37 @@ G_GNUC_INTERNAL WindowData *gtk_x11_window_get_window_data(GtkWindow *window)
 #include <libdbusmenu-gtk/parser.h>
 
 struct org_kde_kwin_appmenu_manager *org_kde_kwin_appmenu_manager = NULL;
+/* Registry name of the bound manager, to recognize its global_remove */
+static uint32_t org_kde_kwin_appmenu_manager_name = 0;
 
 static void registry_global(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
-	if (strcmp(interface, org_kde_kwin_appmenu_manager_interface.name) == 0) {
+	if (strcmp(interface, org_kde_kwin_appmenu_manager_interface.name) == 0 &&
+	    org_kde_kwin_appmenu_manager == NULL) {
 		g_debug("registry_global org_kde_kwin_appmenu_manager");
 		org_kde_kwin_appmenu_manager = wl_registry_bind(registry, name, &org_kde_kwin_appmenu_manager_interface, 1);
+		org_kde_kwin_appmenu_manager_name = name;
+		/* Windows exported before the global went away only need their
+		 * address sent again; dormant ones are exported by the invalidation */
+		gtk_windows_appmenu_manager_changed(true);
+		shell_shows_menubar_invalidate();
 	}
 }
 
+/*
+ * The compositor withdrew the global, e.g. while KWin restarts. The appmenu
+ * objects of every window are released with the manager, the menus stay
+ * exported on the bus until registry_global() binds a new manager.
+ */
 static void registry_global_remove(void *data, struct wl_registry *registry, uint32_t name) {
-	// Do nothing
+	if (org_kde_kwin_appmenu_manager == NULL || name != org_kde_kwin_appmenu_manager_name)
+		return;
+
+	g_debug("registry_global_remove org_kde_kwin_appmenu_manager");
+	gtk_windows_appmenu_manager_changed(false);
+	org_kde_kwin_appmenu_manager_destroy(org_kde_kwin_appmenu_manager);
+	org_kde_kwin_appmenu_manager      = NULL;
+	org_kde_kwin_appmenu_manager_name = 0;
+	shell_shows_menubar_invalidate();
 }
 
 static const struct wl_registry_listener wl_registry_listener = {
@@ -256,9 +323,81 @@ static const struct wl_registry_listener wl_registry_listener = {
 		.global_remove = registry_global_remove,
 };
 
+#define APPMENU_WL_QUEUE "appmenu-gtk-wl-queue"
+
+/*
+ * The registry, the manager and every appmenu object live on a private event
+ * queue, so handling appmenu events never dispatches GDK's own queue from
+ * inside a realize. GDK's event source stays the only reader of the display
+ * fd: a second reader in the same thread would block in
+ * wl_display_read_events(). This source only dispatches what was queued.
+ */
+typedef struct
+{
+	GSource source;
+	struct wl_display *display;
+	struct wl_event_queue *queue;
+} AppmenuQueueSource;
+
+static gboolean appmenu_queue_has_events(AppmenuQueueSource *queue_source)
+{
+	/* Fails without taking a read intent when events are queued */
+	if (wl_display_prepare_read_queue(queue_source->display, queue_source->queue) != 0)
+		return TRUE;
+
+	wl_display_cancel_read(queue_source->display);
+
+	return FALSE;
+}
+
+static gboolean appmenu_queue_source_prepare(GSource *source, gint *timeout)
+{
+	*timeout = -1;
+
+	return appmenu_queue_has_events((AppmenuQueueSource *)source);
+}
+
+static gboolean appmenu_queue_source_check(GSource *source)
+{
+	return appmenu_queue_has_events((AppmenuQueueSource *)source);
+}
+
+static gboolean appmenu_queue_source_dispatch(GSource *source, GSourceFunc callback,
+                                              gpointer user_data)
+{
+	AppmenuQueueSource *queue_source = (AppmenuQueueSource *)source;
+
+	if (wl_display_dispatch_queue_pending(queue_source->display, queue_source->queue) < 0)
+	{
+		g_debug("appmenu_queue_source_dispatch: display error %d",
+		        wl_display_get_error(queue_source->display));
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs appmenu_queue_source_funcs = {
+	appmenu_queue_source_prepare,
+	appmenu_queue_source_check,
+	appmenu_queue_source_dispatch,
+	NULL,
+};
+
+/*
+ * Binds the registry of the display once and returns without waiting: the
+ * manager is picked up by registry_global() whenever the announcement is
+ * dispatched from the private queue. A display without the protocol keeps its
+ * queue, so later calls cost one lookup instead of a roundtrip per window.
+ */
 void appmenu_wl_init()
 {
-	GdkDisplay* disp = gdk_display_get_default();
+	GdkDisplay *disp = gdk_display_get_default();
+	struct wl_display *wl_display;
+	struct wl_display *wrapper;
+	struct wl_registry *wl_registry;
+	AppmenuQueueSource *queue_source;
+
 	if (!disp)
 	{
 		g_debug("no default display");
@@ -269,60 +408,127 @@ void appmenu_wl_init()
 		g_debug("not a wayland display");
 		return;
 	}
-	g_debug("gdk_window_get_display %ld", (long)disp);
-	struct wl_display *wl_display = gdk_wayland_display_get_wl_display(disp);
-	g_debug("gdk_wayland_display_get_wl_display %ld", (long)wl_display);
-	struct wl_registry *wl_registry = wl_display_get_registry(wl_display);
-	g_debug("wl_display_get_registry %ld", (long)wl_registry);
+	if (g_object_get_data(G_OBJECT(disp), APPMENU_WL_QUEUE) != NULL)
+		return;
+
+	wl_display = gdk_wayland_display_get_wl_display(disp);
+	g_debug("appmenu_wl_init: binding registry of wl_display %p", (void *)wl_display);
+
+	queue_source = (AppmenuQueueSource *)g_source_new(&appmenu_queue_source_funcs,
+	                                                  sizeof(AppmenuQueueSource));
+	queue_source->display = wl_display;
+	queue_source->queue   = wl_display_create_queue(wl_display);
+
+	/* Objects created through the registry inherit its queue */
+	wrapper = wl_proxy_create_wrapper(wl_display);
+	wl_proxy_set_queue((struct wl_proxy *)wrapper, queue_source->queue);
+	wl_registry = wl_display_get_registry(wrapper);
+	wl_proxy_wrapper_destroy(wrapper);
 
 	wl_registry_add_listener(wl_registry, &wl_registry_listener, NULL);
-	wl_display_roundtrip(wl_display);
 
-	if (org_kde_kwin_appmenu_manager != NULL)
-	{
-		g_debug("appmenu_wl_init: found org_kde_kwin_appmenu_manager");
-		set_gtk_shell_shows_menubar(true);
-	}
+	g_source_set_name((GSource *)queue_source, "appmenu-gtk wayland queue");
+	g_source_attach((GSource *)queue_source, NULL);
+	g_source_unref((GSource *)queue_source);
+
+	/* Not destroyed with the display, GDK disconnects the wl_display first */
+	g_object_set_data(G_OBJECT(disp), APPMENU_WL_QUEUE, queue_source->queue);
+	wl_display_flush(wl_display);
 }
 
-struct org_kde_kwin_appmenu *appmenu_set_address(GdkWindow* gdk_win, const char* unique_bus_name, const char* menubar_object_path)
+static guint appmenu_flush_source_id = 0;
+
+static gboolean appmenu_flush(gpointer user_data)
 {
+	GdkDisplay *display = gdk_display_get_default();
+
+	appmenu_flush_source_id = 0;
+
+	if (display != NULL && GDK_IS_WAYLAND_DISPLAY(display))
+		wl_display_flush(gdk_wayland_display_get_wl_display(display));
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Requests of all windows announced in one main loop iteration share a flush */
+static void appmenu_schedule_flush(void)
+{
+	if (appmenu_flush_source_id == 0)
+		appmenu_flush_source_id = g_idle_add(appmenu_flush, NULL);
+}
+
+/*
+ * Points the appmenu object of the window at the given menubar. The object is
+ * created once per wl_surface and kept with the WindowData; set_address is
+ * only sent when the service or path differ from what was sent before.
+ */
+void appmenu_set_address(WindowData *window_data, GdkWindow *gdk_win, const char *unique_bus_name,
+                         const char *menubar_object_path)
+{
+	struct wl_surface *wl_surface;
+
 	if (gdk_win == NULL)
 	{
 		g_debug("appmenu_set_address: gdk_win is NULL");
-		return NULL;
+		return;
 	}
 
-	if (org_kde_kwin_appmenu_manager != NULL)
+	if (org_kde_kwin_appmenu_manager == NULL)
 	{
-		g_debug("org_kde_kwin_appmenu_set_address: %s %s", unique_bus_name, menubar_object_path);
-		struct wl_surface *wl_surface = gdk_wayland_window_get_wl_surface(gdk_win);
+		g_debug("org_kde_kwin_appmenu_manager is NULL");
+		return;
+	}
 
-		if (wl_surface == NULL)
-		{
-			g_debug("appmenu_set_address: wl_surface is NULL");
-			return NULL;
-		}
+	wl_surface = gdk_wayland_window_get_wl_surface(gdk_win);
 
-		struct org_kde_kwin_appmenu *appmenu = org_kde_kwin_appmenu_manager_create(org_kde_kwin_appmenu_manager, wl_surface);
-		org_kde_kwin_appmenu_set_address(appmenu, unique_bus_name, menubar_object_path);
+	if (wl_surface == NULL)
+	{
+		g_debug("appmenu_set_address: wl_surface is NULL");
+		return;
+	}
 
-		GdkDisplay *display = gdk_display_get_default();
-		if (display != NULL)
-			wl_display_flush(gdk_wayland_display_get_wl_display(display));
+	/* The window was unrealized and realized again */
+	if (window_data->kde_appmenu != NULL && window_data->kde_appmenu_surface != wl_surface)
+		release_appmenu(window_data);
 
-		return appmenu;
+	if (window_data->kde_appmenu == NULL)
+	{
+		window_data->kde_appmenu =
+		    org_kde_kwin_appmenu_manager_create(org_kde_kwin_appmenu_manager, wl_surface);
+		window_data->kde_appmenu_surface = wl_surface;
 	}
-	else
+	else if (g_strcmp0(window_data->kde_appmenu_service, unique_bus_name) == 0 &&
+	         g_strcmp0(window_data->kde_appmenu_path, menubar_object_path) == 0)
 	{
-		g_debug("org_kde_kwin_appmenu_manager is NULL");
+		g_debug("appmenu_set_address: address unchanged");
+		return;
 	}
-	return NULL;
+
+	g_debug("org_kde_kwin_appmenu_set_address: %s %s", unique_bus_name, menubar_object_path);
+	org_kde_kwin_appmenu_set_address(window_data->kde_appmenu,
+	                                 unique_bus_name,
+	                                 menubar_object_path);
+
+	g_free(window_data->kde_appmenu_service);
+	g_free(window_data->kde_appmenu_path);
+	window_data->kde_appmenu_service = g_strdup(unique_bus_name);
+	window_data->kde_appmenu_path    = g_strdup(menubar_object_path);
+
+	appmenu_schedule_flush();
 }
 
-void release_appmenu(struct org_kde_kwin_appmenu *appmenu)
+void release_appmenu(WindowData *window_data)
 {
-	org_kde_kwin_appmenu_release(appmenu);
+	if (window_data->kde_appmenu != NULL)
+	{
+		org_kde_kwin_appmenu_release(window_data->kde_appmenu);
+		appmenu_schedule_flush();
+	}
+
+	window_data->kde_appmenu         = NULL;
+	window_data->kde_appmenu_surface = NULL;
+	g_clear_pointer(&window_data->kde_appmenu_service, g_free);
+	g_clear_pointer(&window_data->kde_appmenu_path, g_free);
 }
 
 void gdk_wayland_window_set_dbus_properties_libgtk_only(
@@ -333,12 +539,10 @@ void gdk_wayland_window_set_dbus_properties_libgtk_only(
 G_GNUC_INTERNAL WindowData *gtk_wayland_window_get_window_data(GtkWindow *window)
 {
 	g_debug("gtk_wayland_window_get_window_data");
-	if (org_kde_kwin_appmenu_manager == NULL)
-	{
-		appmenu_wl_init();
-	}
 	WindowData *window_data;
 
+	appmenu_wl_init();
+
 	if (window == NULL || !GTK_IS_WINDOW(window))
 		return NULL;
 
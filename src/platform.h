@@ -44,10 +44,12 @@ G_GNUC_INTERNAL WindowData *gtk_x11_window_get_window_data(GtkWindow *window);
 #ifdef GDK_WINDOWING_WAYLAND
 G_GNUC_INTERNAL WindowData *gtk_wayland_window_get_window_data(GtkWindow *window);
 extern struct org_kde_kwin_appmenu_manager *org_kde_kwin_appmenu_manager;
+void appmenu_wl_init();
 #endif
 
-struct org_kde_kwin_appmenu *appmenu_set_address(GdkWindow *gdk_win, const char *unique_bus_name, const char *menubar_object_path);
+void appmenu_set_address(WindowData *window_data, GdkWindow *gdk_win, const char *unique_bus_name,
+                         const char *menubar_object_path);
 
-void release_appmenu(struct org_kde_kwin_appmenu *appmenu);
+void release_appmenu(WindowData *window_data);
 
 #endif // PLATFORM_H
@@ -26,6 +26,7 @@
 #include <gdk/gdkx.h>
 #include <gtk/gtk.h>
 #include <gdk/gdkwayland.h>
+#include <stdlib.h>
 
 #include "blacklist.h"
 #include "consts.h"
@@ -33,8 +34,19 @@
 #include "platform.h"
 
 #if (GTK_MAJOR_VERSION < 3) || defined(GDK_WINDOWING_WAYLAND) || defined(GDK_WINDOWING_X11)
-static uint watcher_ids[4] = { 0, 0, 0, 0 };
-static bool registrar_present[4] = { false, false, false, false };
+typedef enum
+{
+	REGISTRAR_UNKNOWN,
+	REGISTRAR_ABSENT,
+	REGISTRAR_PRESENT,
+} RegistrarState;
+
+/* Registrar bus name to its RegistrarState, each watched through a
+ * NameOwnerChanged subscription matching only that name */
+static GHashTable *registrars         = NULL;
+static guint registrars_present       = 0;
+static bool registrar_state_published = false;
+static bool registrar_state_present   = false;
 
 static const char *const REGISTRAR_NAMES[] = { "com.canonical.AppMenu.Registrar",
                                                "org.kde.KAppMenu",
@@ -42,6 +54,29 @@ static const char *const REGISTRAR_NAMES[] = { "com.canonical.AppMenu.Registrar"
                                                "org.ayatana.AppMenu.Registrar" };
 #endif
 
+typedef struct
+{
+	GObject *object;
+	SessionBusReadyFunc func;
+	/* Whether object was given, it is cleared if it goes away first */
+	bool watched;
+} SessionBusWaiter;
+
+/* One session bus connection shared by every window of the process. It is
+ * requested asynchronously from gtk_module_init(), so realizing a window never
+ * waits for dbus-daemon; work that needs the bus before it arrives is queued. */
+static GDBusConnection *session_bus = NULL;
+static bool session_bus_pending     = false;
+static GSList *session_bus_waiters  = NULL;
+
+#define SETTINGS_CONNECTED "appmenu-gtk-settings-connected"
+
+static int shell_shows_menubar = -1;
+/* Last presence passed to gtk_windows_consumer_changed(), -1 before the first */
+static int consumer_present = -1;
+/* Realized menubars, resized when shell_shows_menubar changes */
+static GHashTable *menubars = NULL;
+
 static bool is_true(const char *value)
 {
 	return value != NULL && value[0] != '\0' && g_ascii_strcasecmp(value, "0") != 0 &&
@@ -49,6 +84,43 @@ static bool is_true(const char *value)
 	       g_ascii_strcasecmp(value, "false") != 0;
 }
 
+G_GNUC_INTERNAL guint module_env_get_uint(const char *name, guint fallback)
+{
+	const char *value = g_getenv(name);
+	char *end         = NULL;
+	guint64 number;
+
+	if (value == NULL || value[0] == '\0')
+		return fallback;
+
+	number = g_ascii_strtoull(value, &end, 10);
+
+	if (end == NULL || *end != '\0' || number > G_MAXUINT)
+		return fallback;
+
+	return (guint)number;
+}
+
+/* Logged once when the process exits, only if STATISTICS_ENV is set */
+static GSList *statistics_funcs = NULL;
+
+static void module_statistics_log(void)
+{
+	for (GSList *iter = statistics_funcs; iter != NULL; iter = g_slist_next(iter))
+		((ModuleStatisticsFunc)iter->data)();
+}
+
+G_GNUC_INTERNAL void module_statistics_add(ModuleStatisticsFunc func)
+{
+	if (module_env_get_uint(STATISTICS_ENV, 0) == 0)
+		return;
+
+	if (statistics_funcs == NULL)
+		atexit(module_statistics_log);
+
+	statistics_funcs = g_slist_append(statistics_funcs, (gpointer)func);
+}
+
 G_GNUC_INTERNAL bool gtk_module_should_run()
 {
 	const char *proxy          = g_getenv("UBUNTU_MENUPROXY");
@@ -76,27 +148,19 @@ G_GNUC_INTERNAL bool gtk_module_should_run()
 	return should_run;
 }
 
-G_GNUC_INTERNAL bool gtk_widget_shell_shows_menubar(GtkWidget *widget)
+static bool shell_shows_menubar_compute(GtkSettings *settings)
 {
 #if (GTK_MAJOR_VERSION < 3) || defined(GDK_WINDOWING_WAYLAND) || defined(GDK_WINDOWING_X11)
-	for (int i = 0; i < 4; i++)
-	{
-		if (registrar_present[i])
-			return true;
-	}
+	if (registrars_present > 0)
+		return true;
 #ifdef GDK_WINDOWING_WAYLAND
 	if (org_kde_kwin_appmenu_manager != NULL)
 		return true;
 #endif
 #endif
-	GtkSettings *settings;
 	GParamSpec *pspec;
 	gboolean shell_shows_menubar;
 
-	g_return_val_if_fail(GTK_IS_WIDGET(widget), false);
-
-	settings = gtk_widget_get_settings(widget);
-
 	g_return_val_if_fail(GTK_IS_SETTINGS(settings), false);
 
 	pspec =
@@ -111,25 +175,102 @@ G_GNUC_INTERNAL bool gtk_widget_shell_shows_menubar(GtkWidget *widget)
 
 	return shell_shows_menubar;
 }
+
+/*
+ * Asked by every size request and allocation of every menubar, so the answer
+ * is kept until shell_shows_menubar_invalidate() is called because one of its
+ * inputs changed. -1 while unknown.
+ */
+G_GNUC_INTERNAL bool gtk_widget_shell_shows_menubar(GtkWidget *widget)
+{
+	if (shell_shows_menubar < 0)
+	{
+		g_return_val_if_fail(GTK_IS_WIDGET(widget), false);
+
+		shell_shows_menubar = shell_shows_menubar_compute(gtk_widget_get_settings(widget));
+	}
+
+	return shell_shows_menubar;
+}
+
+/*
+ * Whether something reads the exported menus: a registrar on the bus or the
+ * appmenu global of the compositor. Unlike gtk_widget_shell_shows_menubar()
+ * this ignores GtkSettings, which the user or the desktop may set either way.
+ */
+G_GNUC_INTERNAL bool appmenu_consumer_present()
+{
+	bool present = false;
+#if (GTK_MAJOR_VERSION < 3) || defined(GDK_WINDOWING_WAYLAND) || defined(GDK_WINDOWING_X11)
+	present = registrars_present > 0;
+#ifdef GDK_WINDOWING_WAYLAND
+	if (org_kde_kwin_appmenu_manager != NULL)
+		present = true;
+#endif
+#endif
+	return present;
+}
+
+/* Recomputes the answer and resizes the menubars if it changed */
+G_GNUC_INTERNAL void shell_shows_menubar_invalidate()
+{
+	GtkSettings *settings = gtk_settings_get_default();
+	int old_value         = shell_shows_menubar;
+	bool present          = appmenu_consumer_present();
+	GHashTableIter iter;
+	gpointer widget;
+
+	/* Every change of a consumer ends up here, GtkSettings ones are ignored */
+	if (consumer_present != present)
+	{
+		consumer_present = present;
+		gtk_windows_consumer_changed(present);
+	}
+
+	shell_shows_menubar = settings != NULL ? shell_shows_menubar_compute(settings) : -1;
+
+	if (shell_shows_menubar == old_value)
+		return;
+
+	if (menubars == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, menubars);
+
+	while (g_hash_table_iter_next(&iter, &widget, NULL))
+		gtk_widget_queue_resize(widget);
+}
+
 static void gtk_settings_handle_gtk_shell_shows_menubar(GObject *object, GParamSpec *pspec,
                                                         gpointer user_data)
 {
-	gtk_widget_queue_resize(user_data);
+	shell_shows_menubar_invalidate();
 }
+
 G_GNUC_INTERNAL void gtk_widget_connect_settings(GtkWidget *widget)
 {
 	GtkSettings *settings = gtk_widget_get_settings(widget);
-	g_signal_connect(settings,
-	                 "notify::gtk-shell-shows-menubar",
-	                 G_CALLBACK(gtk_settings_handle_gtk_shell_shows_menubar),
-	                 widget);
+
+	if (menubars == NULL)
+		menubars = g_hash_table_new(NULL, NULL);
+
+	g_hash_table_add(menubars, widget);
+
+	/* One handler per GtkSettings, whatever the number of menubars */
+	if (settings != NULL && g_object_get_data(G_OBJECT(settings), SETTINGS_CONNECTED) == NULL)
+	{
+		g_object_set_data(G_OBJECT(settings), SETTINGS_CONNECTED, settings);
+		g_signal_connect(settings,
+		                 "notify::gtk-shell-shows-menubar",
+		                 G_CALLBACK(gtk_settings_handle_gtk_shell_shows_menubar),
+		                 NULL);
+	}
 }
 
 G_GNUC_INTERNAL void gtk_widget_disconnect_settings(GtkWidget *widget)
 {
-	GtkSettings *settings = gtk_widget_get_settings(widget);
-	if (settings != NULL)
-		g_signal_handlers_disconnect_by_data(settings, widget);
+	if (menubars != NULL)
+		g_hash_table_remove(menubars, widget);
 }
 
 #if (GTK_MAJOR_VERSION < 3) || defined(GDK_WINDOWING_WAYLAND) || defined(GDK_WINDOWING_X11)
@@ -157,108 +298,269 @@ G_GNUC_INTERNAL bool set_gtk_shell_shows_menubar(bool shows)
 
 static void update_registrar_state()
 {
-	bool any_present = false;
-	for (int i = 0; i < 4; i++)
-	{
-		if (registrar_present[i])
-		{
-			any_present = true;
-			break;
-		}
-	}
+	bool any_present = registrars_present > 0;
 #ifdef GDK_WINDOWING_WAYLAND
 	if (org_kde_kwin_appmenu_manager != NULL)
 		any_present = true;
 #endif
-	set_gtk_shell_shows_menubar(any_present);
+	/* Owner changes of unrelated registrars do not touch GtkSettings */
+	if (registrar_state_published && registrar_state_present == any_present)
+		return;
+
+	if (set_gtk_shell_shows_menubar(any_present))
+	{
+		registrar_state_published = true;
+		registrar_state_present   = any_present;
+	}
+
+	shell_shows_menubar_invalidate();
 }
 
-static void on_name_appeared(GDBusConnection *connection, const char *name, const char *name_owner,
-                             gpointer user_data)
+/* Returns whether the state of name changed */
+static bool registrar_set_state(const char *name, RegistrarState state)
 {
-	g_debug("Name %s on the session bus is owned by %s", name, name_owner);
+	gpointer key;
+	gpointer value;
+	RegistrarState old_state;
 
-	int index = GPOINTER_TO_INT(user_data);
-	registrar_present[index] = true;
-	update_registrar_state();
+	if (!g_hash_table_lookup_extended(registrars, name, &key, &value))
+		return false;
+
+	old_state = (RegistrarState)GPOINTER_TO_INT(value);
+
+	if (old_state == state)
+		return false;
+
+	if (old_state == REGISTRAR_PRESENT)
+		registrars_present--;
+	else if (state == REGISTRAR_PRESENT)
+		registrars_present++;
+
+	g_hash_table_insert(registrars, key, GINT_TO_POINTER(state));
+
+	return true;
+}
+
+static void on_name_owner_changed(GDBusConnection *connection, const char *sender_name,
+                                  const char *object_path, const char *interface_name,
+                                  const char *signal_name, GVariant *parameters,
+                                  gpointer user_data)
+{
+	const char *name;
+	const char *new_owner;
+
+	if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE("(sss)")))
+		return;
+
+	g_variant_get(parameters, "(&s&s&s)", &name, NULL, &new_owner);
+
+	/* Every name on the bus comes through here, most are not registrars */
+	if (!g_hash_table_contains(registrars, name))
+		return;
+
+	if (registrar_set_state(name, new_owner[0] != '\0' ? REGISTRAR_PRESENT : REGISTRAR_ABSENT))
+	{
+		g_debug("Name %s on the session bus is %s",
+		        name,
+		        new_owner[0] != '\0' ? "owned" : "released");
+		update_registrar_state();
+	}
 }
 
-static void on_name_vanished(GDBusConnection *connection, const char *name, gpointer user_data)
+static void on_list_names_ready(GObject *source, GAsyncResult *result, gpointer user_data)
 {
-	g_debug("Name %s does not exist on the session bus", name);
+	GError *error = NULL;
+	GVariant *ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &error);
+	GHashTableIter hash_iter;
+	GVariantIter *iter;
+	const char *name;
+	gpointer value;
+
+	if (ret == NULL)
+	{
+		g_debug("Unable to query dbus for ListNames: %s", error->message);
+		g_error_free(error);
+		return;
+	}
+
+	g_variant_get(ret, "(as)", &iter);
+
+	/* Names NameOwnerChanged already told us about are more recent */
+	while (g_variant_iter_loop(iter, "&s", &name))
+		if (g_hash_table_lookup_extended(registrars, name, NULL, &value) &&
+		    GPOINTER_TO_INT(value) == REGISTRAR_UNKNOWN)
+			registrar_set_state(name, REGISTRAR_PRESENT);
 
-	int index = GPOINTER_TO_INT(user_data);
-	registrar_present[index] = false;
+	g_hash_table_iter_init(&hash_iter, registrars);
+
+	while (g_hash_table_iter_next(&hash_iter, NULL, &value))
+		if (GPOINTER_TO_INT(value) == REGISTRAR_UNKNOWN)
+			g_hash_table_iter_replace(&hash_iter, GINT_TO_POINTER(REGISTRAR_ABSENT));
+
+	g_variant_iter_free(iter);
+	g_variant_unref(ret);
 	update_registrar_state();
 }
+
+static void on_registrar_bus_ready(GObject *object, GDBusConnection *connection)
+{
+	/* Subscribed before ListNames, so no change falls in between */
+	g_dbus_connection_signal_subscribe(connection,
+	                                   "org.freedesktop.DBus",
+	                                   "org.freedesktop.DBus",
+	                                   "NameOwnerChanged",
+	                                   "/org/freedesktop/DBus",
+	                                   NULL,
+	                                   G_DBUS_SIGNAL_FLAGS_NONE,
+	                                   on_name_owner_changed,
+	                                   NULL,
+	                                   NULL);
+
+	/* A wedged dbus-daemon leaves the menubar in the window instead of
+	 * keeping the question open */
+	g_dbus_connection_call(connection,
+	                       "org.freedesktop.DBus",
+	                       "/org/freedesktop/DBus",
+	                       "org.freedesktop.DBus",
+	                       "ListNames",
+	                       NULL,
+	                       G_VARIANT_TYPE("(as)"),
+	                       G_DBUS_CALL_FLAGS_NONE,
+	                       (int)module_env_get_uint(REGISTRAR_TIMEOUT_ENV,
+	                                                REGISTRAR_TIMEOUT_DEFAULT),
+	                       NULL,
+	                       on_list_names_ready,
+	                       NULL);
+}
+
+/* The registrar names from REGISTRARS_ENV, a comma separated list, or the
+ * built in ones */
+static void registrars_init()
+{
+	const char *value = g_getenv(REGISTRARS_ENV);
+	char **names      = NULL;
+
+	registrars = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if (value != NULL && value[0] != '\0')
+		names = g_strsplit(value, ",", -1);
+
+	for (char **iter = names; iter != NULL && *iter != NULL; iter++)
+	{
+		g_strstrip(*iter);
+
+		if (g_dbus_is_name(*iter) && !g_dbus_is_unique_name(*iter))
+			g_hash_table_insert(registrars,
+			                    g_strdup(*iter),
+			                    GINT_TO_POINTER(REGISTRAR_UNKNOWN));
+	}
+
+	g_strfreev(names);
+
+	if (g_hash_table_size(registrars) == 0)
+		for (gsize i = 0; i < G_N_ELEMENTS(REGISTRAR_NAMES); i++)
+			g_hash_table_insert(registrars,
+			                    g_strdup(REGISTRAR_NAMES[i]),
+			                    GINT_TO_POINTER(REGISTRAR_UNKNOWN));
+}
 #endif
 
 G_GNUC_INTERNAL void watch_registrar_dbus()
 {
 #if (GTK_MAJOR_VERSION < 3) || defined(GDK_WINDOWING_WAYLAND) || defined(GDK_WINDOWING_X11)
-	if (watcher_ids[0] == 0)
+	if (registrars == NULL)
 	{
-		for (int i = 0; i < 4; i++)
-			registrar_present[i] = false;
+		registrars_init();
 
-		GError *error               = NULL;
-		GDBusConnection *connection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
-		if (connection == NULL)
-		{
-			g_debug("Unable to connect to dbus: %s", error->message);
-			g_error_free(error);
-		}
-		else
-		{
-			GVariant *ret = g_dbus_connection_call_sync(connection,
-			                                            "org.freedesktop.DBus",
-			                                            "/org/freedesktop/DBus",
-			                                            "org.freedesktop.DBus",
-			                                            "ListNames",
-			                                            NULL,
-			                                            G_VARIANT_TYPE("(as)"),
-			                                            G_DBUS_CALL_FLAGS_NONE,
-			                                            -1,
-			                                            NULL,
-			                                            &error);
-			if (ret == NULL)
-			{
-				g_debug("Unable to query dbus for ListNames: %s", error->message);
-				g_error_free(error);
-			}
-			else
-			{
-				GVariant *names = g_variant_get_child_value(ret, 0);
-				GVariantIter iter;
-				char *name;
-				g_variant_iter_init(&iter, names);
-				while (g_variant_iter_loop(&iter, "&s", &name))
-				{
-					for (int i = 0; i < 4; i++)
-					{
-						if (g_str_equal(name, REGISTRAR_NAMES[i]))
-						{
-							registrar_present[i] = true;
-						}
-					}
-				}
-				g_variant_unref(names);
-				g_variant_unref(ret);
-			}
-			g_object_unref(connection);
-		}
+		/* Runs from gtk_module_init(), so nothing here may wait for the bus.
+		 * The menubar stays in the window until a registrar shows up. */
+		session_bus_when_ready(NULL, on_registrar_bus_ready);
+	}
+	update_registrar_state();
+#endif
+}
+
+static void on_session_bus_ready(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	GError *error = NULL;
+	GSList *waiters;
+
+	session_bus_pending = false;
+	session_bus         = g_bus_get_finish(result, &error);
+
+	if (session_bus == NULL)
+	{
+		g_debug("Unable to connect to the session bus: %s", error->message);
+		g_error_free(error);
+	}
+
+	waiters             = g_slist_reverse(session_bus_waiters);
+	session_bus_waiters = NULL;
 
-		for (int i = 0; i < 4; i++)
+	for (GSList *iter = waiters; iter != NULL; iter = g_slist_next(iter))
+	{
+		SessionBusWaiter *waiter = iter->data;
+		GObject *object          = waiter->object;
+
+		if (object != NULL || !waiter->watched)
 		{
-			watcher_ids[i] = g_bus_watch_name(G_BUS_TYPE_SESSION,
-			                                  REGISTRAR_NAMES[i],
-			                                  G_BUS_NAME_WATCHER_FLAGS_NONE,
-			                                  on_name_appeared,
-			                                  on_name_vanished,
-			                                  GINT_TO_POINTER(i),
-			                                  NULL);
+			if (object != NULL)
+				g_object_remove_weak_pointer(object, (gpointer *)&waiter->object);
+
+			if (session_bus != NULL)
+				waiter->func(object, session_bus);
 		}
+
+		g_slice_free(SessionBusWaiter, waiter);
 	}
-	update_registrar_state();
-#endif
+
+	g_slist_free(waiters);
+}
+
+G_GNUC_INTERNAL void session_bus_init()
+{
+	if (session_bus != NULL || session_bus_pending)
+		return;
+
+	session_bus_pending = true;
+	g_bus_get(G_BUS_TYPE_SESSION, NULL, on_session_bus_ready, NULL);
+}
+
+G_GNUC_INTERNAL GDBusConnection *session_bus_peek()
+{
+	return session_bus;
+}
+
+/* Calls func once the shared connection is up, unless object is finalized
+ * first. A NULL object waits for the lifetime of the process. */
+G_GNUC_INTERNAL void session_bus_when_ready(GObject *object, SessionBusReadyFunc func)
+{
+	SessionBusWaiter *waiter;
+
+	g_return_if_fail(object == NULL || G_IS_OBJECT(object));
+
+	if (session_bus != NULL)
+	{
+		func(object, session_bus);
+		return;
+	}
+
+	for (GSList *iter = session_bus_waiters; iter != NULL; iter = g_slist_next(iter))
+	{
+		waiter = iter->data;
+
+		if (waiter->object == object && waiter->watched == (object != NULL) && waiter->func == func)
+			return;
+	}
+
+	waiter          = g_slice_new0(SessionBusWaiter);
+	waiter->object  = object;
+	waiter->func    = func;
+	waiter->watched = object != NULL;
+
+	if (object != NULL)
+		g_object_add_weak_pointer(object, (gpointer *)&waiter->object);
+
+	session_bus_waiters = g_slist_prepend(session_bus_waiters, waiter);
+	session_bus_init();
 }
@@ -28,12 +28,22 @@
 #include <gtk/gtk.h>
 #include <stdbool.h>
 
+typedef void (*SessionBusReadyFunc)(GObject *object, GDBusConnection *connection);
+typedef void (*ModuleStatisticsFunc)(void);
+
 G_GNUC_INTERNAL bool gtk_widget_shell_shows_menubar(GtkWidget *widget);
+G_GNUC_INTERNAL void shell_shows_menubar_invalidate();
+G_GNUC_INTERNAL bool appmenu_consumer_present();
 G_GNUC_INTERNAL void gtk_widget_connect_settings(GtkWidget *widget);
 G_GNUC_INTERNAL void gtk_widget_disconnect_settings(GtkWidget *widget);
 G_GNUC_INTERNAL bool gtk_module_should_run();
 G_GNUC_INTERNAL void watch_registrar_dbus();
 G_GNUC_INTERNAL bool set_gtk_shell_shows_menubar(bool shows);
 G_GNUC_INTERNAL void enable_debug();
+G_GNUC_INTERNAL guint module_env_get_uint(const char *name, guint fallback);
+G_GNUC_INTERNAL void module_statistics_add(ModuleStatisticsFunc func);
+G_GNUC_INTERNAL void session_bus_init();
+G_GNUC_INTERNAL GDBusConnection *session_bus_peek();
+G_GNUC_INTERNAL void session_bus_when_ready(GObject *object, SessionBusReadyFunc func);
 
 #endif
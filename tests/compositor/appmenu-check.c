@@ -0,0 +1,648 @@
+/*
+ * Checks the exported menus of the module the way a panel sees them, against
+ * the headless compositor and a private session bus, e.g.
+ *
+ *   tests/compositor/check.sh _build/tests/appmenu-compositor \
+ *       _build/tests/appmenu-check layout
+ *
+ * Every check builds a window with a menubar, waits until the module has put
+ * it on the bus and then talks to it over a second connection, like a panel
+ * in another process would. The exit status is 0 when the check passes, 1
+ * when it fails and 77 when it cannot run.
+ *
+ *   submenu  AboutToShow activates the submenu item every time, the "opened"
+ *            and "closed" events show and hide the GtkMenu
+ *   batch    changes made in one batching window arrive as a single
+ *            ItemsPropertiesUpdated, a label set back to the value last sent
+ *            is left out unless the panel read the menu in between
+ *   layout   GetLayout is answered after an AboutToShow sent before it, and
+ *            follows changes of the menu
+ *   manager  withdrawing the appmenu global releases the appmenu of the
+ *            window, advertising it again announces the menubar again
+ */
+
+#include <gtk/gtk.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DBUSMENU_INTERFACE "com.canonical.dbusmenu"
+#define CHECK_TIMEOUT_SECONDS 10
+#define CHECK_SETTLE_MS 200
+#define CHECK_BATCH_MS "500"
+
+typedef struct
+{
+	const char *name;
+	void (*run)(void);
+} Check;
+
+static GtkWidget *window;
+static GtkWidget *file_item;
+static GtkWidget *file_menu;
+static GtkWidget *open_item;
+static GtkWidget *quit_item;
+static guint file_activations;
+
+/* The module's connection, and the one we play the panel on */
+static GDBusConnection *module_bus;
+static GDBusConnection *panel_bus;
+static char *menubar_path;
+
+static guint properties_updates;
+static GVariant *last_properties_update;
+
+static void check_fail(const char *format, ...) G_GNUC_PRINTF(1, 2);
+
+static void check_fail(const char *format, ...)
+{
+	va_list args;
+	char *message;
+
+	va_start(args, format);
+	message = g_strdup_vprintf(format, args);
+	va_end(args);
+
+	g_printerr("FAIL: %s\n", message);
+	g_free(message);
+
+	exit(1);
+}
+
+static void check_skip(const char *reason)
+{
+	g_print("SKIP: %s\n", reason);
+	exit(77);
+}
+
+static gboolean on_check_timeout(gpointer user_data)
+{
+	check_fail("no result after %d seconds", CHECK_TIMEOUT_SECONDS);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean on_tick(gpointer user_data)
+{
+	return G_SOURCE_CONTINUE;
+}
+
+/* Runs the main loop until done returns TRUE, the tick keeps polls going */
+static void wait_until(gboolean (*done)(gpointer), gpointer user_data)
+{
+	while (!done(user_data))
+		g_main_context_iteration(NULL, TRUE);
+}
+
+static gboolean settle_done(gpointer user_data)
+{
+	return g_get_monotonic_time() >= *(gint64 *)user_data;
+}
+
+/* Lets the module and the bus finish whatever was started */
+static void settle(void)
+{
+	gint64 deadline = g_get_monotonic_time() + CHECK_SETTLE_MS * 1000;
+
+	wait_until(settle_done, &deadline);
+}
+
+typedef struct
+{
+	GVariant *reply;
+	GError *error;
+	gboolean done;
+} PendingCall;
+
+static void on_call_ready(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	PendingCall *call = user_data;
+
+	call->reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &call->error);
+	call->done  = TRUE;
+}
+
+/* Sends a call to the menubar without waiting, so several can be in flight */
+static PendingCall *menu_call_begin(const char *path, const char *interface, const char *method,
+                                    GVariant *parameters, const char *reply_type)
+{
+	PendingCall *call = g_new0(PendingCall, 1);
+
+	g_dbus_connection_call(panel_bus,
+	                       g_dbus_connection_get_unique_name(module_bus),
+	                       path,
+	                       interface,
+	                       method,
+	                       parameters,
+	                       G_VARIANT_TYPE(reply_type),
+	                       G_DBUS_CALL_FLAGS_NONE,
+	                       -1,
+	                       NULL,
+	                       on_call_ready,
+	                       call);
+
+	return call;
+}
+
+static gboolean pending_call_done(gpointer user_data)
+{
+	return ((PendingCall *)user_data)->done;
+}
+
+static GVariant *menu_call_finish(PendingCall *call, const char *method)
+{
+	GVariant *reply;
+
+	wait_until(pending_call_done, call);
+
+	if (call->reply == NULL)
+		check_fail("%s failed: %s", method, call->error->message);
+
+	reply = call->reply;
+	g_free(call);
+
+	return reply;
+}
+
+static GVariant *menu_call(const char *method, GVariant *parameters, const char *reply_type)
+{
+	return menu_call_finish(menu_call_begin(menubar_path,
+	                                        DBUSMENU_INTERFACE,
+	                                        method,
+	                                        parameters,
+	                                        reply_type),
+	                        method);
+}
+
+/* Returns the (ia{sv}av) layout below parent */
+static GVariant *menu_get_layout(gint parent)
+{
+	GVariant *reply = menu_call("GetLayout",
+	                            g_variant_new("(ii@as)", parent, -1, g_variant_new_strv(NULL, 0)),
+	                            "(u(ia{sv}av))");
+	GVariant *layout = g_variant_get_child_value(reply, 1);
+
+	g_variant_unref(reply);
+
+	return layout;
+}
+
+/* Returns the ID of the item labelled label in layout, or -1 */
+static gint layout_find(GVariant *layout, const char *label)
+{
+	GVariant *properties;
+	GVariant *children;
+	const char *item_label;
+	GVariantIter iter;
+	GVariant *child;
+	gint id;
+
+	g_variant_get(layout, "(i@a{sv}@av)", &id, &properties, &children);
+
+	if (!g_variant_lookup(properties, "label", "&s", &item_label) ||
+	    g_strcmp0(item_label, label) != 0)
+	{
+		id = -1;
+		g_variant_iter_init(&iter, children);
+
+		while (id < 0 && g_variant_iter_next(&iter, "v", &child))
+		{
+			id = layout_find(child, label);
+			g_variant_unref(child);
+		}
+	}
+
+	g_variant_unref(properties);
+	g_variant_unref(children);
+
+	return id;
+}
+
+static gint menu_find(const char *label)
+{
+	GVariant *layout = menu_get_layout(0);
+	gint id          = layout_find(layout, label);
+
+	g_variant_unref(layout);
+
+	if (id < 0)
+		check_fail("no item labelled %s in the exported menu", label);
+
+	return id;
+}
+
+static void menu_event(gint id, const char *event)
+{
+	g_variant_unref(menu_call("Event",
+	                          g_variant_new("(isvu)", id, event, g_variant_new_int32(0), 0),
+	                          "()"));
+}
+
+static void on_file_activate(GtkMenuItem *item, gpointer user_data)
+{
+	file_activations++;
+
+	/* Like an application filling a submenu when it is opened */
+	if (file_activations == 1)
+	{
+		GtkWidget *recent_item = gtk_menu_item_new_with_label("Recent");
+
+		gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), recent_item);
+		gtk_widget_show(recent_item);
+	}
+}
+
+static void window_build(void)
+{
+	GtkWidget *box     = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+	GtkWidget *menubar = gtk_menu_bar_new();
+
+	window    = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	file_item = gtk_menu_item_new_with_label("File");
+	file_menu = gtk_menu_new();
+	open_item = gtk_menu_item_new_with_label("Open");
+	quit_item = gtk_menu_item_new_with_label("Quit");
+
+	/* Not gtk_widget_show_all(file_menu), the check wants the menu hidden */
+	gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), open_item);
+	gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), quit_item);
+	gtk_widget_show(open_item);
+	gtk_widget_show(quit_item);
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(file_item), file_menu);
+	gtk_menu_shell_append(GTK_MENU_SHELL(menubar), file_item);
+	g_signal_connect(file_item, "activate", G_CALLBACK(on_file_activate), NULL);
+
+	gtk_window_set_title(GTK_WINDOW(window), "appmenu-check");
+	gtk_container_add(GTK_CONTAINER(window), box);
+	gtk_box_pack_start(GTK_BOX(box), menubar, FALSE, FALSE, 0);
+}
+
+static gboolean menubar_exported(gpointer user_data)
+{
+	PendingCall *call = menu_call_begin("/MenuBar",
+	                                    "org.freedesktop.DBus.Introspectable",
+	                                    "Introspect",
+	                                    NULL,
+	                                    "(s)");
+	GDBusNodeInfo *node = NULL;
+	const char *xml;
+
+	/* Fails until the server of the menubar is registered */
+	wait_until(pending_call_done, call);
+
+	if (call->reply != NULL)
+	{
+		g_variant_get(call->reply, "(&s)", &xml);
+		node = g_dbus_node_info_new_for_xml(xml, NULL);
+		g_variant_unref(call->reply);
+	}
+
+	if (node != NULL && node->nodes != NULL && node->nodes[0] != NULL)
+		menubar_path = g_strdup_printf("/MenuBar/%s", node->nodes[0]->path);
+
+	g_clear_pointer(&node, g_dbus_node_info_unref);
+	g_clear_error(&call->error);
+	g_free(call);
+
+	if (menubar_path == NULL)
+		settle();
+
+	return menubar_path != NULL;
+}
+
+static gboolean export_complete(gpointer user_data)
+{
+	return *(gboolean *)user_data;
+}
+
+static void on_export_complete(GtkWindow *window, gpointer user_data)
+{
+	*(gboolean *)user_data = TRUE;
+}
+
+/* Shows the window and waits until every item is on the bus */
+static void window_export(void)
+{
+	static gboolean complete = FALSE;
+	GError *error            = NULL;
+	char *address;
+
+	if (g_signal_lookup("appmenu-export-complete", GTK_TYPE_WINDOW) == 0)
+		check_skip("the module is not loaded, check GTK_MODULES");
+
+	/* The signal may come while the window is mapped */
+	window_build();
+	g_signal_connect(window, "appmenu-export-complete", G_CALLBACK(on_export_complete), &complete);
+	gtk_widget_show_all(window);
+
+	module_bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+	address    = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, NULL, &error);
+	panel_bus  = address != NULL ? g_dbus_connection_new_for_address_sync(
+	                                  address,
+	                                  G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+	                                      G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+	                                  NULL,
+	                                  NULL,
+	                                  &error)
+	                            : NULL;
+	g_free(address);
+
+	if (module_bus == NULL || panel_bus == NULL)
+		check_skip(error->message);
+
+	wait_until(export_complete, &complete);
+	wait_until(menubar_exported, NULL);
+	settle();
+}
+
+static void check_submenu(void)
+{
+	gint file_id;
+
+	window_export();
+	file_id = menu_find("File");
+
+	for (guint i = 1; i <= 2; i++)
+	{
+		g_variant_unref(menu_call("AboutToShow", g_variant_new("(i)", file_id), "(b)"));
+
+		if (file_activations != i)
+			check_fail("AboutToShow %u activated the submenu item %u times", i, file_activations);
+	}
+
+	menu_event(file_id, "opened");
+	settle();
+
+	if (!gtk_widget_get_visible(file_menu))
+		check_fail("the submenu is not shown after \"opened\"");
+
+	menu_event(file_id, "closed");
+	settle();
+
+	if (gtk_widget_get_visible(file_menu))
+		check_fail("the submenu is still shown after \"closed\"");
+}
+
+static void on_items_properties_updated(GDBusConnection *connection, const char *sender_name,
+                                        const char *object_path, const char *interface_name,
+                                        const char *signal_name, GVariant *parameters,
+                                        gpointer user_data)
+{
+	properties_updates++;
+	g_clear_pointer(&last_properties_update, g_variant_unref);
+	last_properties_update = g_variant_ref(parameters);
+}
+
+/* Returns the value of property of item id in an ItemsPropertiesUpdated */
+static GVariant *properties_update_lookup(GVariant *update, gint id, const char *property)
+{
+	GVariant *value = NULL;
+	GVariantIter *iter;
+	GVariant *properties;
+	gint item_id;
+
+	g_variant_get(update, "(a(ia{sv})a(ias))", &iter, NULL);
+
+	while (value == NULL && g_variant_iter_next(iter, "(i@a{sv})", &item_id, &properties))
+	{
+		if (item_id == id)
+			value = g_variant_lookup_value(properties, property, NULL);
+
+		g_variant_unref(properties);
+	}
+
+	g_variant_iter_free(iter);
+
+	return value;
+}
+
+static gboolean properties_updated(gpointer user_data)
+{
+	return properties_updates >= GPOINTER_TO_UINT(user_data);
+}
+
+static void check_batch(void)
+{
+	GVariant *layout;
+	GVariant *label;
+	GVariant *enabled;
+	gint open_id;
+	gint quit_id;
+
+	window_export();
+	open_id = menu_find("Open");
+	quit_id = menu_find("Quit");
+
+	g_dbus_connection_signal_subscribe(panel_bus,
+	                                   g_dbus_connection_get_unique_name(module_bus),
+	                                   DBUSMENU_INTERFACE,
+	                                   "ItemsPropertiesUpdated",
+	                                   menubar_path,
+	                                   NULL,
+	                                   G_DBUS_SIGNAL_FLAGS_NONE,
+	                                   on_items_properties_updated,
+	                                   NULL,
+	                                   NULL);
+	settle();
+	properties_updates = 0;
+
+	/* The panel has seen "Open", then the label goes to "Close" and back */
+	gtk_menu_item_set_label(GTK_MENU_ITEM(open_item), "Close");
+	gtk_menu_item_set_label(GTK_MENU_ITEM(open_item), "Open");
+	gtk_widget_set_sensitive(quit_item, FALSE);
+	wait_until(properties_updated, GUINT_TO_POINTER(1));
+	settle();
+
+	if (properties_updates != 1)
+		check_fail("%u ItemsPropertiesUpdated for one batch", properties_updates);
+
+	label   = properties_update_lookup(last_properties_update, open_id, "label");
+	enabled = properties_update_lookup(last_properties_update, quit_id, "enabled");
+
+	if (label != NULL)
+		check_fail("the label back at the value last sent was sent again");
+
+	if (enabled == NULL || g_variant_get_boolean(enabled))
+		check_fail("the disabled item was not sent");
+
+	g_variant_unref(enabled);
+
+	/* Reading the menu inside the window flushes it, so the panel is told
+	 * about "Close" before the reply and about "Open" afterwards */
+	gtk_menu_item_set_label(GTK_MENU_ITEM(open_item), "Close");
+	layout = menu_get_layout(0);
+
+	if (layout_find(layout, "Close") < 0)
+		check_fail("GetLayout inside the window does not have the pending label");
+
+	g_variant_unref(layout);
+	gtk_menu_item_set_label(GTK_MENU_ITEM(open_item), "Open");
+	wait_until(properties_updated, GUINT_TO_POINTER(3));
+	label = properties_update_lookup(last_properties_update, open_id, "label");
+
+	if (label == NULL || g_strcmp0(g_variant_get_string(label, NULL), "Open") != 0)
+		check_fail("the label set back to Open after a read was not sent");
+
+	g_variant_unref(label);
+}
+
+static void check_layout(void)
+{
+	PendingCall *about_to_show;
+	PendingCall *get_layout;
+	GVariant *layout;
+	GVariant *reply;
+	gint file_id;
+
+	window_export();
+	file_id = menu_find("File");
+
+	/* Both in flight at once: the item added by the activation has to be in
+	 * the layout, as the calls arrive in this order */
+	about_to_show = menu_call_begin(menubar_path,
+	                                DBUSMENU_INTERFACE,
+	                                "AboutToShow",
+	                                g_variant_new("(i)", file_id),
+	                                "(b)");
+	get_layout =
+	    menu_call_begin(menubar_path,
+	                    DBUSMENU_INTERFACE,
+	                    "GetLayout",
+	                    g_variant_new("(ii@as)", file_id, -1, g_variant_new_strv(NULL, 0)),
+	                    "(u(ia{sv}av))");
+
+	reply = menu_call_finish(get_layout, "GetLayout");
+	g_variant_unref(menu_call_finish(about_to_show, "AboutToShow"));
+
+	layout = g_variant_get_child_value(reply, 1);
+
+	if (layout_find(layout, "Recent") < 0)
+		check_fail("GetLayout was answered before the AboutToShow sent ahead of it");
+
+	g_variant_unref(layout);
+	g_variant_unref(reply);
+
+	gtk_menu_item_set_label(GTK_MENU_ITEM(open_item), "Open Again");
+	settle();
+
+	layout = menu_get_layout(0);
+
+	if (layout_find(layout, "Open Again") < 0 || layout_find(layout, "Open") >= 0)
+		check_fail("GetLayout still returns the old label");
+
+	g_variant_unref(layout);
+}
+
+typedef struct
+{
+	const char *log;
+	const char *needle;
+	guint count;
+} LogWait;
+
+static guint log_count(const char *log, const char *needle)
+{
+	char *contents   = NULL;
+	const char *iter = NULL;
+	guint count      = 0;
+
+	if (g_file_get_contents(log, &contents, NULL, NULL))
+		iter = strstr(contents, needle);
+
+	while (iter != NULL)
+	{
+		count++;
+		iter = strstr(iter + 1, needle);
+	}
+
+	g_free(contents);
+
+	return count;
+}
+
+static gboolean log_has(gpointer user_data)
+{
+	LogWait *wait = user_data;
+
+	if (log_count(wait->log, wait->needle) >= wait->count)
+		return TRUE;
+
+	settle();
+
+	return FALSE;
+}
+
+static void check_manager(void)
+{
+	const char *log = g_getenv("APPMENU_CHECK_LOG");
+	const char *pid = g_getenv("APPMENU_CHECK_COMPOSITOR_PID");
+	LogWait wait    = { log, NULL, 1 };
+	char *address;
+
+	if (log == NULL || pid == NULL)
+		check_skip("APPMENU_CHECK_LOG and APPMENU_CHECK_COMPOSITOR_PID are not set");
+
+	window_export();
+	address = g_strdup_printf(" set_address client %u ", (guint)getpid());
+
+	wait.needle = address;
+	wait_until(log_has, &wait);
+
+	kill(atoi(pid), SIGUSR1);
+	wait.needle = "withdraw org_kde_kwin_appmenu_manager";
+	wait_until(log_has, &wait);
+	wait.needle = " release ";
+	wait_until(log_has, &wait);
+
+	kill(atoi(pid), SIGUSR1);
+	wait.needle = address;
+	wait.count  = 2;
+	wait_until(log_has, &wait);
+
+	g_free(address);
+}
+
+static const Check checks[] = {
+	{ "submenu", check_submenu },
+	{ "batch", check_batch },
+	{ "layout", check_layout },
+	{ "manager", check_manager },
+};
+
+int main(int argc, char **argv)
+{
+	if (argc != 2)
+	{
+		g_printerr("usage: %s submenu|batch|layout|manager\n", argv[0]);
+		return 1;
+	}
+
+	for (gsize i = 0; i < G_N_ELEMENTS(checks); i++)
+	{
+		if (g_strcmp0(argv[1], checks[i].name) != 0)
+			continue;
+
+		/* The module reads it once, when the first menu is exported */
+		if (g_strcmp0(checks[i].name, "layout") == 0)
+			g_setenv("APPMENU_GTK_MENU_MODE", "lazy", TRUE);
+
+		/* Long enough for the panel to read the menu inside the window */
+		if (g_strcmp0(checks[i].name, "batch") == 0)
+			g_setenv("APPMENU_GTK_BATCH_MS", CHECK_BATCH_MS, TRUE);
+
+		if (!gtk_init_check(&argc, &argv))
+			check_skip("cannot open the display");
+
+		g_timeout_add_seconds(CHECK_TIMEOUT_SECONDS, on_check_timeout, NULL);
+		g_timeout_add(20, on_tick, NULL);
+		checks[i].run();
+		g_print("PASS: %s\n", checks[i].name);
+
+		return 0;
+	}
+
+	g_printerr("unknown check %s\n", argv[1]);
+
+	return 1;
+}
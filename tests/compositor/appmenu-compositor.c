@@ -0,0 +1,832 @@
+/*
+ * A headless stand-in for a Wayland compositor that implements just enough
+ * of wl_compositor, wl_shm and xdg_wm_base for GTK 3 clients to map windows,
+ * and advertises org_kde_kwin_appmenu_manager, e.g.
+ *
+ *   ./appmenu-compositor --socket appmenu-test &
+ *   WAYLAND_DISPLAY=appmenu-test GDK_BACKEND=wayland \
+ *       GTK_MODULES=appmenu-gtk-module ./realizebench
+ *
+ * Nothing is rendered: buffers are released and frame callbacks completed as
+ * soon as a surface is committed. Every create, set_address and release of an
+ * appmenu is printed with its g_get_monotonic_time() timestamp, set_address
+ * together with the time since the wl_surface it belongs to was created. On
+ * SIGINT or SIGTERM the counts and latencies are summarized.
+ *
+ * With --no-appmenu the manager global is left out, like on GNOME or sway.
+ * SIGUSR1 withdraws the global, or advertises it again, like a compositor
+ * that restarts the component providing it.
+ */
+
+#include <glib.h>
+#include <signal.h>
+#include <stdio.h>
+#include <wayland-server.h>
+
+#include "appmenu-server-protocol.h"
+#include "xdg-shell-server-protocol.h"
+
+static char *socket_name;
+static gboolean no_appmenu;
+
+static GOptionEntry entries[] = {
+	{ "socket", 's', 0, G_OPTION_ARG_STRING, &socket_name, "Name of the listening socket", "NAME" },
+	{ "no-appmenu", 0, 0, G_OPTION_ARG_NONE, &no_appmenu, "Do not advertise the appmenu manager",
+	  NULL },
+	{ NULL }
+};
+
+static struct wl_display *display;
+static struct wl_global *appmenu_manager_global;
+
+static struct
+{
+	guint creates;
+	guint set_addresses;
+	guint releases;
+	guint addressed;
+	gint64 latency_total;
+	gint64 latency_max;
+} statistics;
+
+typedef struct
+{
+	struct wl_resource *resource;
+	struct wl_resource *buffer;
+	struct wl_listener buffer_destroy;
+	struct wl_list frame_callbacks;
+	gint64 created;
+} Surface;
+
+typedef struct
+{
+	guint surface_id;
+	gint64 surface_created;
+	gboolean addressed;
+} Appmenu;
+
+static void resource_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static guint32 client_pid(struct wl_client *client)
+{
+	pid_t pid;
+
+	wl_client_get_credentials(client, &pid, NULL, NULL);
+
+	return pid;
+}
+
+/* wl_region, never used for anything */
+
+static void region_add(struct wl_client *client, struct wl_resource *resource, int32_t x,
+                       int32_t y, int32_t width, int32_t height)
+{
+}
+
+static const struct wl_region_interface region_implementation = {
+	.destroy  = resource_destroy,
+	.add      = region_add,
+	.subtract = region_add,
+};
+
+/* wl_surface */
+
+static void surface_clear_buffer(Surface *surface)
+{
+	if (surface->buffer != NULL)
+	{
+		wl_list_remove(&surface->buffer_destroy.link);
+		surface->buffer = NULL;
+	}
+}
+
+static void on_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+	Surface *surface = wl_container_of(listener, surface, buffer_destroy);
+
+	surface_clear_buffer(surface);
+}
+
+static void surface_attach(struct wl_client *client, struct wl_resource *resource,
+                           struct wl_resource *buffer, int32_t x, int32_t y)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+
+	surface_clear_buffer(surface);
+
+	if (buffer != NULL)
+	{
+		surface->buffer                = buffer;
+		surface->buffer_destroy.notify = on_buffer_destroyed;
+		wl_resource_add_destroy_listener(buffer, &surface->buffer_destroy);
+	}
+}
+
+static void surface_damage(struct wl_client *client, struct wl_resource *resource, int32_t x,
+                           int32_t y, int32_t width, int32_t height)
+{
+}
+
+static void frame_callback_destroy(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void surface_frame(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback;
+
+	callback = wl_resource_create(client, &wl_callback_interface, 1, id);
+
+	if (callback == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(callback, NULL, NULL, frame_callback_destroy);
+	wl_list_insert(surface->frame_callbacks.prev, wl_resource_get_link(callback));
+}
+
+static void surface_set_region(struct wl_client *client, struct wl_resource *resource,
+                               struct wl_resource *region)
+{
+}
+
+/* Nothing is drawn, so the buffer is done with and the frame is over */
+static void surface_commit(struct wl_client *client, struct wl_resource *resource)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	guint32 time     = g_get_monotonic_time() / 1000;
+	struct wl_resource *callback;
+	struct wl_resource *next;
+
+	if (surface->buffer != NULL)
+	{
+		wl_buffer_send_release(surface->buffer);
+		surface_clear_buffer(surface);
+	}
+
+	wl_resource_for_each_safe (callback, next, &surface->frame_callbacks)
+	{
+		wl_callback_send_done(callback, time);
+		wl_resource_destroy(callback);
+	}
+}
+
+static void surface_set_int(struct wl_client *client, struct wl_resource *resource, int32_t value)
+{
+}
+
+static const struct wl_surface_interface surface_implementation = {
+	.destroy              = resource_destroy,
+	.attach               = surface_attach,
+	.damage               = surface_damage,
+	.frame                = surface_frame,
+	.set_opaque_region    = surface_set_region,
+	.set_input_region     = surface_set_region,
+	.commit               = surface_commit,
+	.set_buffer_transform = surface_set_int,
+	.set_buffer_scale     = surface_set_int,
+	.damage_buffer        = surface_damage,
+};
+
+static void surface_resource_destroy(struct wl_resource *resource)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback;
+	struct wl_resource *next;
+
+	surface_clear_buffer(surface);
+
+	wl_resource_for_each_safe (callback, next, &surface->frame_callbacks)
+		wl_resource_destroy(callback);
+
+	g_free(surface);
+}
+
+/* wl_compositor */
+
+static void compositor_create_surface(struct wl_client *client, struct wl_resource *resource,
+                                      uint32_t id)
+{
+	Surface *surface = g_new0(Surface, 1);
+
+	surface->resource =
+	    wl_resource_create(client, &wl_surface_interface, wl_resource_get_version(resource), id);
+
+	if (surface->resource == NULL)
+	{
+		g_free(surface);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	surface->created = g_get_monotonic_time();
+	wl_list_init(&surface->frame_callbacks);
+	wl_resource_set_implementation(surface->resource,
+	                               &surface_implementation,
+	                               surface,
+	                               surface_resource_destroy);
+}
+
+static void compositor_create_region(struct wl_client *client, struct wl_resource *resource,
+                                     uint32_t id)
+{
+	struct wl_resource *region = wl_resource_create(client, &wl_region_interface, 1, id);
+
+	if (region == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(region, &region_implementation, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_implementation = {
+	.create_surface = compositor_create_surface,
+	.create_region  = compositor_create_region,
+};
+
+static void bind_compositor(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wl_compositor_interface, version, id);
+
+	if (resource == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &compositor_implementation, NULL, NULL);
+}
+
+/* wl_output, one 1920x1080 monitor */
+
+static void bind_output(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wl_output_interface, version, id);
+
+	if (resource == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, NULL, NULL, NULL);
+	wl_output_send_geometry(resource,
+	                        0,
+	                        0,
+	                        510,
+	                        287,
+	                        WL_OUTPUT_SUBPIXEL_UNKNOWN,
+	                        "appmenu-compositor",
+	                        "headless",
+	                        WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_output_send_mode(resource,
+	                    WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+	                    1920,
+	                    1080,
+	                    60000);
+	wl_output_send_scale(resource, 1);
+	wl_output_send_done(resource);
+}
+
+/* wl_seat without any capability, and the data device GTK asks every seat for */
+
+static void seat_get_device(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	wl_client_post_implementation_error(client, "the seat has no input devices");
+}
+
+static const struct wl_seat_interface seat_implementation = {
+	.get_pointer  = seat_get_device,
+	.get_keyboard = seat_get_device,
+	.get_touch    = seat_get_device,
+};
+
+static void bind_seat(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wl_seat_interface, version, id);
+
+	if (resource == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &seat_implementation, NULL, NULL);
+	wl_seat_send_capabilities(resource, 0);
+
+	if (version >= WL_SEAT_NAME_SINCE_VERSION)
+		wl_seat_send_name(resource, "seat0");
+}
+
+static void data_source_offer(struct wl_client *client, struct wl_resource *resource,
+                              const char *mime_type)
+{
+}
+
+static void data_source_set_actions(struct wl_client *client, struct wl_resource *resource,
+                                    uint32_t dnd_actions)
+{
+}
+
+static const struct wl_data_source_interface data_source_implementation = {
+	.offer       = data_source_offer,
+	.destroy     = resource_destroy,
+	.set_actions = data_source_set_actions,
+};
+
+static void data_device_start_drag(struct wl_client *client, struct wl_resource *resource,
+                                   struct wl_resource *source, struct wl_resource *origin,
+                                   struct wl_resource *icon, uint32_t serial)
+{
+}
+
+static void data_device_set_selection(struct wl_client *client, struct wl_resource *resource,
+                                      struct wl_resource *source, uint32_t serial)
+{
+}
+
+static const struct wl_data_device_interface data_device_implementation = {
+	.start_drag    = data_device_start_drag,
+	.set_selection = data_device_set_selection,
+	.release       = resource_destroy,
+};
+
+static void data_device_manager_create_data_source(struct wl_client *client,
+                                                   struct wl_resource *resource, uint32_t id)
+{
+	struct wl_resource *source =
+	    wl_resource_create(client, &wl_data_source_interface, wl_resource_get_version(resource), id);
+
+	if (source == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(source, &data_source_implementation, NULL, NULL);
+}
+
+static void data_device_manager_get_data_device(struct wl_client *client,
+                                                struct wl_resource *resource, uint32_t id,
+                                                struct wl_resource *seat)
+{
+	struct wl_resource *device =
+	    wl_resource_create(client, &wl_data_device_interface, wl_resource_get_version(resource), id);
+
+	if (device == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(device, &data_device_implementation, NULL, NULL);
+}
+
+static const struct wl_data_device_manager_interface data_device_manager_implementation = {
+	.create_data_source = data_device_manager_create_data_source,
+	.get_data_device    = data_device_manager_get_data_device,
+};
+
+static void bind_data_device_manager(struct wl_client *client, void *data, uint32_t version,
+                                     uint32_t id)
+{
+	struct wl_resource *resource =
+	    wl_resource_create(client, &wl_data_device_manager_interface, version, id);
+
+	if (resource == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &data_device_manager_implementation, NULL, NULL);
+}
+
+/* xdg_wm_base, every toplevel is configured to the size the client picks */
+
+static void positioner_set_size(struct wl_client *client, struct wl_resource *resource,
+                                int32_t width, int32_t height)
+{
+}
+
+static void positioner_set_anchor_rect(struct wl_client *client, struct wl_resource *resource,
+                                       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+}
+
+static void positioner_set_uint(struct wl_client *client, struct wl_resource *resource,
+                                uint32_t value)
+{
+}
+
+static const struct xdg_positioner_interface positioner_implementation = {
+	.destroy                   = resource_destroy,
+	.set_size                  = positioner_set_size,
+	.set_anchor_rect           = positioner_set_anchor_rect,
+	.set_anchor                = positioner_set_uint,
+	.set_gravity               = positioner_set_uint,
+	.set_constraint_adjustment = positioner_set_uint,
+	.set_offset                = positioner_set_size,
+};
+
+static void toplevel_set_parent(struct wl_client *client, struct wl_resource *resource,
+                                struct wl_resource *parent)
+{
+}
+
+static void toplevel_set_string(struct wl_client *client, struct wl_resource *resource,
+                                const char *value)
+{
+}
+
+static void toplevel_show_window_menu(struct wl_client *client, struct wl_resource *resource,
+                                      struct wl_resource *seat, uint32_t serial, int32_t x,
+                                      int32_t y)
+{
+}
+
+static void toplevel_move(struct wl_client *client, struct wl_resource *resource,
+                          struct wl_resource *seat, uint32_t serial)
+{
+}
+
+static void toplevel_resize(struct wl_client *client, struct wl_resource *resource,
+                            struct wl_resource *seat, uint32_t serial, uint32_t edges)
+{
+}
+
+static void toplevel_set_state(struct wl_client *client, struct wl_resource *resource)
+{
+}
+
+static void toplevel_set_fullscreen(struct wl_client *client, struct wl_resource *resource,
+                                    struct wl_resource *output)
+{
+}
+
+static const struct xdg_toplevel_interface toplevel_implementation = {
+	.destroy          = resource_destroy,
+	.set_parent       = toplevel_set_parent,
+	.set_title        = toplevel_set_string,
+	.set_app_id       = toplevel_set_string,
+	.show_window_menu = toplevel_show_window_menu,
+	.move             = toplevel_move,
+	.resize           = toplevel_resize,
+	.set_max_size     = positioner_set_size,
+	.set_min_size     = positioner_set_size,
+	.set_maximized    = toplevel_set_state,
+	.unset_maximized  = toplevel_set_state,
+	.set_fullscreen   = toplevel_set_fullscreen,
+	.unset_fullscreen = toplevel_set_state,
+	.set_minimized    = toplevel_set_state,
+};
+
+static void popup_grab(struct wl_client *client, struct wl_resource *resource,
+                       struct wl_resource *seat, uint32_t serial)
+{
+}
+
+static const struct xdg_popup_interface popup_implementation = {
+	.destroy = resource_destroy,
+	.grab    = popup_grab,
+};
+
+static void xdg_surface_get_toplevel(struct wl_client *client, struct wl_resource *resource,
+                                     uint32_t id)
+{
+	struct wl_resource *toplevel =
+	    wl_resource_create(client, &xdg_toplevel_interface, wl_resource_get_version(resource), id);
+	struct wl_array states;
+
+	if (toplevel == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(toplevel, &toplevel_implementation, NULL, NULL);
+
+	wl_array_init(&states);
+	xdg_toplevel_send_configure(toplevel, 0, 0, &states);
+	wl_array_release(&states);
+	xdg_surface_send_configure(resource, wl_display_next_serial(display));
+}
+
+static void xdg_surface_get_popup(struct wl_client *client, struct wl_resource *resource,
+                                  uint32_t id, struct wl_resource *parent,
+                                  struct wl_resource *positioner)
+{
+	struct wl_resource *popup =
+	    wl_resource_create(client, &xdg_popup_interface, wl_resource_get_version(resource), id);
+
+	if (popup == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(popup, &popup_implementation, NULL, NULL);
+	xdg_popup_send_configure(popup, 0, 0, 1, 1);
+	xdg_surface_send_configure(resource, wl_display_next_serial(display));
+}
+
+static void xdg_surface_set_window_geometry(struct wl_client *client, struct wl_resource *resource,
+                                            int32_t x, int32_t y, int32_t width, int32_t height)
+{
+}
+
+static void xdg_surface_ack_configure(struct wl_client *client, struct wl_resource *resource,
+                                      uint32_t serial)
+{
+}
+
+static const struct xdg_surface_interface xdg_surface_implementation = {
+	.destroy             = resource_destroy,
+	.get_toplevel        = xdg_surface_get_toplevel,
+	.get_popup           = xdg_surface_get_popup,
+	.set_window_geometry = xdg_surface_set_window_geometry,
+	.ack_configure       = xdg_surface_ack_configure,
+};
+
+static void wm_base_create_positioner(struct wl_client *client, struct wl_resource *resource,
+                                      uint32_t id)
+{
+	struct wl_resource *positioner =
+	    wl_resource_create(client, &xdg_positioner_interface, wl_resource_get_version(resource), id);
+
+	if (positioner == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(positioner, &positioner_implementation, NULL, NULL);
+}
+
+static void wm_base_get_xdg_surface(struct wl_client *client, struct wl_resource *resource,
+                                    uint32_t id, struct wl_resource *surface)
+{
+	struct wl_resource *xdg_surface =
+	    wl_resource_create(client, &xdg_surface_interface, wl_resource_get_version(resource), id);
+
+	if (xdg_surface == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(xdg_surface, &xdg_surface_implementation, NULL, NULL);
+}
+
+static void wm_base_pong(struct wl_client *client, struct wl_resource *resource, uint32_t serial)
+{
+}
+
+static const struct xdg_wm_base_interface wm_base_implementation = {
+	.destroy           = resource_destroy,
+	.create_positioner = wm_base_create_positioner,
+	.get_xdg_surface   = wm_base_get_xdg_surface,
+	.pong              = wm_base_pong,
+};
+
+static void bind_wm_base(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &xdg_wm_base_interface, version, id);
+
+	if (resource == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &wm_base_implementation, NULL, NULL);
+}
+
+/* org_kde_kwin_appmenu_manager, the part under test */
+
+static void appmenu_set_address(struct wl_client *client, struct wl_resource *resource,
+                                const char *service_name, const char *object_path)
+{
+	Appmenu *appmenu = wl_resource_get_user_data(resource);
+	gint64 now       = g_get_monotonic_time();
+	gint64 latency   = now - appmenu->surface_created;
+
+	statistics.set_addresses++;
+
+	/* Only the first address of a surface counts as its realize latency */
+	if (!appmenu->addressed)
+	{
+		appmenu->addressed = TRUE;
+		statistics.addressed++;
+		statistics.latency_total += latency;
+		statistics.latency_max = MAX(statistics.latency_max, latency);
+	}
+
+	g_print("%" G_GINT64_FORMAT " set_address client %u appmenu %u surface %u %s %s "
+	        "%.3f ms after the surface was created\n",
+	        now,
+	        client_pid(client),
+	        wl_resource_get_id(resource),
+	        appmenu->surface_id,
+	        service_name,
+	        object_path,
+	        latency / 1000.0);
+}
+
+static void appmenu_release(struct wl_client *client, struct wl_resource *resource)
+{
+	Appmenu *appmenu = wl_resource_get_user_data(resource);
+
+	statistics.releases++;
+
+	g_print("%" G_GINT64_FORMAT " release client %u appmenu %u surface %u\n",
+	        g_get_monotonic_time(),
+	        client_pid(client),
+	        wl_resource_get_id(resource),
+	        appmenu->surface_id);
+
+	wl_resource_destroy(resource);
+}
+
+static const struct org_kde_kwin_appmenu_interface appmenu_implementation = {
+	.set_address = appmenu_set_address,
+	.release     = appmenu_release,
+};
+
+static void appmenu_resource_destroy(struct wl_resource *resource)
+{
+	g_free(wl_resource_get_user_data(resource));
+}
+
+static void appmenu_manager_create(struct wl_client *client, struct wl_resource *resource,
+                                   uint32_t id, struct wl_resource *surface_resource)
+{
+	Surface *surface = wl_resource_get_user_data(surface_resource);
+	Appmenu *appmenu = g_new0(Appmenu, 1);
+	struct wl_resource *appmenu_resource;
+
+	appmenu_resource = wl_resource_create(client,
+	                                      &org_kde_kwin_appmenu_interface,
+	                                      wl_resource_get_version(resource),
+	                                      id);
+
+	if (appmenu_resource == NULL)
+	{
+		g_free(appmenu);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	appmenu->surface_id      = wl_resource_get_id(surface_resource);
+	appmenu->surface_created = surface->created;
+	wl_resource_set_implementation(appmenu_resource,
+	                               &appmenu_implementation,
+	                               appmenu,
+	                               appmenu_resource_destroy);
+
+	statistics.creates++;
+
+	g_print("%" G_GINT64_FORMAT " create client %u appmenu %u surface %u\n",
+	        g_get_monotonic_time(),
+	        client_pid(client),
+	        id,
+	        appmenu->surface_id);
+}
+
+static const struct org_kde_kwin_appmenu_manager_interface appmenu_manager_implementation = {
+	.create = appmenu_manager_create,
+};
+
+static void bind_appmenu_manager(struct wl_client *client, void *data, uint32_t version,
+                                 uint32_t id)
+{
+	struct wl_resource *resource =
+	    wl_resource_create(client, &org_kde_kwin_appmenu_manager_interface, version, id);
+
+	if (resource == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &appmenu_manager_implementation, NULL, NULL);
+}
+
+static void appmenu_manager_advertise(void)
+{
+	appmenu_manager_global = wl_global_create(display,
+	                                          &org_kde_kwin_appmenu_manager_interface,
+	                                          1,
+	                                          NULL,
+	                                          bind_appmenu_manager);
+}
+
+static int on_toggle_signal(int signal_number, void *data)
+{
+	if (appmenu_manager_global != NULL)
+	{
+		wl_global_destroy(appmenu_manager_global);
+		appmenu_manager_global = NULL;
+	}
+	else
+	{
+		appmenu_manager_advertise();
+	}
+
+	g_print("%" G_GINT64_FORMAT " %s org_kde_kwin_appmenu_manager\n",
+	        g_get_monotonic_time(),
+	        appmenu_manager_global != NULL ? "advertise" : "withdraw");
+
+	return 0;
+}
+
+static int on_signal(int signal_number, void *data)
+{
+	wl_display_terminate(display);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context = g_option_context_new("- headless appmenu test compositor");
+	GError *error           = NULL;
+	struct wl_event_loop *loop;
+	struct wl_event_source *sigint;
+	struct wl_event_source *sigterm;
+	struct wl_event_source *sigusr1;
+	const char *name;
+
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	/* The log is usually piped into a file or another process */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	display = wl_display_create();
+	name    = socket_name;
+
+	if (name != NULL ? wl_display_add_socket(display, name) != 0
+	                 : (name = wl_display_add_socket_auto(display)) == NULL)
+	{
+		g_printerr("cannot listen on %s\n", name != NULL ? name : "any socket");
+		return 1;
+	}
+
+	wl_display_init_shm(display);
+	wl_global_create(display, &wl_compositor_interface, 4, NULL, bind_compositor);
+	wl_global_create(display, &wl_output_interface, 2, NULL, bind_output);
+	wl_global_create(display, &wl_seat_interface, 2, NULL, bind_seat);
+	wl_global_create(display, &wl_data_device_manager_interface, 3, NULL, bind_data_device_manager);
+	wl_global_create(display, &xdg_wm_base_interface, 1, NULL, bind_wm_base);
+
+	if (!no_appmenu)
+		appmenu_manager_advertise();
+
+	loop    = wl_display_get_event_loop(display);
+	sigint  = wl_event_loop_add_signal(loop, SIGINT, on_signal, NULL);
+	sigterm = wl_event_loop_add_signal(loop, SIGTERM, on_signal, NULL);
+	sigusr1 = wl_event_loop_add_signal(loop, SIGUSR1, on_toggle_signal, NULL);
+
+	g_print("%" G_GINT64_FORMAT " listening on %s%s\n",
+	        g_get_monotonic_time(),
+	        name,
+	        no_appmenu ? " without org_kde_kwin_appmenu_manager" : "");
+
+	wl_display_run(display);
+
+	g_print("%u create, %u set_address, %u release",
+	        statistics.creates,
+	        statistics.set_addresses,
+	        statistics.releases);
+
+	if (statistics.addressed > 0)
+		g_print(", surface to set_address %.3f ms on average, %.3f ms at most",
+		        statistics.latency_total / 1000.0 / statistics.addressed,
+		        statistics.latency_max / 1000.0);
+
+	g_print("\n");
+
+	wl_event_source_remove(sigint);
+	wl_event_source_remove(sigterm);
+	wl_event_source_remove(sigusr1);
+	wl_display_destroy_clients(display);
+	wl_display_destroy(display);
+	g_option_context_free(context);
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Runs one check of appmenu-check against the headless appmenu compositor, on
+# a session bus of its own, e.g.
+#
+#   tests/compositor/check.sh _build/tests/appmenu-compositor _build/tests/appmenu-check batch
+#
+# The check gets the module through GTK_MODULES, which may be an absolute
+# path to a module that is not installed. The compositor log is passed to the
+# check and printed when it fails.
+
+if [ $# -ne 3 ]; then
+  echo "usage: $0 COMPOSITOR CHECK NAME" >&2
+  exit 1
+fi
+
+# Registrars or panels of the desktop would answer in place of the check
+if [ -z "$APPMENU_CHECK_BUS" ]; then
+  APPMENU_CHECK_BUS=1 exec dbus-run-session -- "$0" "$@"
+fi
+
+compositor=$1
+check=$2
+name=$3
+
+created_runtime_dir=
+if [ -n "$XDG_RUNTIME_DIR" ]; then
+  runtime_dir=$XDG_RUNTIME_DIR
+else
+  runtime_dir=$(mktemp -d)
+  created_runtime_dir=1
+fi
+socket=appmenu-check-$$
+log=$(mktemp)
+compositor_pid=
+
+# Also runs when the client fails or the script is interrupted
+cleanup() {
+  if [ -n "$compositor_pid" ]; then
+    kill -TERM "$compositor_pid" 2> /dev/null
+    wait "$compositor_pid"
+  fi
+  rm -f "$log"
+  if [ -n "$created_runtime_dir" ]; then
+    rm -rf "$runtime_dir"
+  fi
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+XDG_RUNTIME_DIR=$runtime_dir "$compositor" --socket "$socket" > "$log" &
+compositor_pid=$!
+
+while [ ! -S "$runtime_dir/$socket" ]; do
+  if ! kill -0 "$compositor_pid" 2> /dev/null; then
+    cat "$log"
+    exit 1
+  fi
+  sleep 0.1
+done
+
+XDG_RUNTIME_DIR=$runtime_dir WAYLAND_DISPLAY=$socket GDK_BACKEND=wayland \
+  APPMENU_CHECK_LOG=$log APPMENU_CHECK_COMPOSITOR_PID=$compositor_pid \
+  GTK_MODULES=${GTK_MODULES:-appmenu-gtk-module} "$check" "$name"
+status=$?
+
+kill -TERM "$compositor_pid"
+wait "$compositor_pid"
+compositor_pid=
+
+if [ $status -ne 0 ] && [ $status -ne 77 ]; then
+  cat "$log"
+fi
+
+exit $status
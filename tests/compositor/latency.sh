@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Compares the realize to set_address latency of two builds of the module,
+# e.g. before and after a change:
+#
+#   tests/compositor/latency.sh _build/tests/appmenu-compositor \
+#       _build/tests/realizebench old/libappmenu-gtk-module.so \
+#       _build/src/libappmenu-gtk-module.so
+#
+# Every build runs realizebench under run.sh, and its line of the
+# compositor's summary is printed, e.g. "surface to set_address 1.234 ms on
+# average, 5.678 ms at most". Extra arguments go to the benchmark.
+
+if [ $# -lt 4 ]; then
+  echo "usage: $0 COMPOSITOR BENCHMARK BEFORE_MODULE AFTER_MODULE [ARGS...]" >&2
+  exit 1
+fi
+
+run=$(dirname "$0")/run.sh
+compositor=$1
+benchmark=$2
+before=$3
+after=$4
+shift 4
+
+for module in "$before" "$after"; do
+  summary=$(GTK_MODULES=$module "$run" "$compositor" "$benchmark" "$@" |
+            grep 'surface to set_address')
+
+  if [ -z "$summary" ]; then
+    echo "$module: no set_address was seen" >&2
+    exit 1
+  fi
+
+  echo "$module: $summary"
+done
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Runs a client against the headless appmenu compositor and prints the
+# compositor's log and summary afterwards, e.g.
+#
+#   tests/compositor/run.sh _build/tests/appmenu-compositor _build/tests/realizebench
+#   tests/compositor/run.sh -n _build/tests/appmenu-compositor _build/tests/realizebench
+#
+# -n leaves org_kde_kwin_appmenu_manager out. The client gets the module
+# through GTK_MODULES and its own session bus if none is running.
+
+no_appmenu=
+if [ "$1" = "-n" ]; then
+  no_appmenu=--no-appmenu
+  shift
+fi
+
+if [ $# -lt 2 ]; then
+  echo "usage: $0 [-n] COMPOSITOR CLIENT [ARGS...]" >&2
+  exit 1
+fi
+
+if [ -z "$DBUS_SESSION_BUS_ADDRESS" ]; then
+  exec dbus-run-session -- "$0" ${no_appmenu:+-n} "$@"
+fi
+
+compositor=$1
+shift
+
+created_runtime_dir=
+if [ -n "$XDG_RUNTIME_DIR" ]; then
+  runtime_dir=$XDG_RUNTIME_DIR
+else
+  runtime_dir=$(mktemp -d)
+  created_runtime_dir=1
+fi
+socket=appmenu-compositor-$$
+log=$(mktemp)
+compositor_pid=
+
+# Also runs when the client fails or the script is interrupted
+cleanup() {
+  if [ -n "$compositor_pid" ]; then
+    kill -TERM "$compositor_pid" 2> /dev/null
+    wait "$compositor_pid"
+  fi
+  rm -f "$log"
+  if [ -n "$created_runtime_dir" ]; then
+    rm -rf "$runtime_dir"
+  fi
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+XDG_RUNTIME_DIR=$runtime_dir "$compositor" --socket "$socket" $no_appmenu > "$log" &
+compositor_pid=$!
+
+while [ ! -S "$runtime_dir/$socket" ]; do
+  if ! kill -0 "$compositor_pid" 2> /dev/null; then
+    cat "$log"
+    exit 1
+  fi
+  sleep 0.1
+done
+
+XDG_RUNTIME_DIR=$runtime_dir WAYLAND_DISPLAY=$socket GDK_BACKEND=wayland \
+  GTK_MODULES=${GTK_MODULES:-appmenu-gtk-module} "$@"
+status=$?
+
+kill -TERM "$compositor_pid"
+wait "$compositor_pid"
+compositor_pid=
+cat "$log"
+
+exit $status
@@ -0,0 +1,110 @@
+/*
+ * Compares the size of the icon-data payload of a representative menu when
+ * the icons are sent as raw (iiib@ay) pixel tuples and as PNG byte arrays.
+ *
+ * Usage: icon-payload [icon-theme] [scale]
+ */
+
+#include <gtk/gtk.h>
+
+static const char *const menu_icons[] = {
+	"document-new", "document-open", "document-save", "document-save-as",
+	"document-print", "document-properties", "document-close", "application-exit",
+	"edit-undo", "edit-redo", "edit-cut", "edit-copy",
+	"edit-paste", "edit-delete", "edit-select-all", "edit-find",
+	"edit-find-replace", "view-refresh", "view-fullscreen", "zoom-in",
+	"zoom-out", "zoom-original", "go-previous", "go-next",
+	"go-home", "bookmark-new", "list-add", "list-remove",
+	"preferences-system", "help-contents", "help-about", "window-close",
+};
+
+static gsize raw_size(GdkPixbuf *pixbuf)
+{
+	GVariant *pixels = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE,
+	                                             gdk_pixbuf_get_pixels(pixbuf),
+	                                             (gsize)gdk_pixbuf_get_height(pixbuf) *
+	                                                 gdk_pixbuf_get_rowstride(pixbuf),
+	                                             1);
+	GVariant *data   = g_variant_new("(iiib@ay)",
+	                                 gdk_pixbuf_get_width(pixbuf),
+	                                 gdk_pixbuf_get_height(pixbuf),
+	                                 gdk_pixbuf_get_rowstride(pixbuf),
+	                                 gdk_pixbuf_get_has_alpha(pixbuf),
+	                                 pixels);
+	gsize size;
+
+	g_variant_ref_sink(data);
+	size = g_variant_get_size(data);
+
+	g_variant_unref(data);
+
+	return size;
+}
+
+static gsize png_size(GdkPixbuf *pixbuf)
+{
+	gchar *buffer = NULL;
+	gsize size    = 0;
+
+	if (!gdk_pixbuf_save_to_buffer(pixbuf, &buffer, &size, "png", NULL, NULL))
+		return 0;
+
+	g_free(buffer);
+
+	return size;
+}
+
+int main(int argc, char *argv[])
+{
+	GtkIconTheme *icon_theme = gtk_icon_theme_new();
+	gint scale               = argc > 2 ? (gint)g_ascii_strtoll(argv[2], NULL, 10) : 1;
+	gint width = 16, height = 16;
+	gsize raw_total = 0, png_total = 0;
+	guint found     = 0;
+
+	gtk_icon_size_lookup(GTK_ICON_SIZE_MENU, &width, &height);
+	gtk_icon_theme_set_custom_theme(icon_theme, argc > 1 ? argv[1] : "Adwaita");
+
+	if (scale < 1)
+		scale = 1;
+
+	g_print("%-24s %10s %10s\n", "icon", "raw", "png");
+
+	for (gsize i = 0; i < G_N_ELEMENTS(menu_icons); i++)
+	{
+		GdkPixbuf *pixbuf = gtk_icon_theme_load_icon_for_scale(icon_theme,
+		                                                       menu_icons[i],
+		                                                       width,
+		                                                       scale,
+		                                                       GTK_ICON_LOOKUP_FORCE_SIZE,
+		                                                       NULL);
+		gsize raw, png;
+
+		if (pixbuf == NULL)
+			continue;
+
+		raw = raw_size(pixbuf);
+		png = png_size(pixbuf);
+
+		g_print("%-24s %10" G_GSIZE_FORMAT " %10" G_GSIZE_FORMAT "\n", menu_icons[i], raw, png);
+
+		raw_total += raw;
+		png_total += png;
+		found++;
+		g_object_unref(pixbuf);
+	}
+
+	g_print("%-24s %10" G_GSIZE_FORMAT " %10" G_GSIZE_FORMAT "\n", "total", raw_total, png_total);
+
+	if (raw_total > 0)
+		g_print("%u icons at %dx%d@%d: PNG is %.1f%% of the raw payload\n",
+		        found,
+		        width,
+		        width,
+		        scale,
+		        100.0 * png_total / raw_total);
+
+	g_object_unref(icon_theme);
+
+	return found > 0 ? 0 : 1;
+}
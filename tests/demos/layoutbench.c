@@ -0,0 +1,260 @@
+/*
+ * Measures repeated GetLayout calls on the exported menu of a large menubar,
+ * the way a panel fetches a menu every time the user opens it, e.g.
+ *
+ *   GTK_MODULES=appmenu-gtk-module ./layoutbench
+ *   GTK_MODULES=appmenu-gtk-module APPMENU_GTK_LAYOUT_CACHE=0 ./layoutbench
+ *
+ * The default menubar has 20 menus of 100 items, i.e. 2000 items. With
+ * --mutate one item changes its sensitivity before every call.
+ */
+
+#include <gtk/gtk.h>
+#include <stdlib.h>
+
+#define DBUSMENU_INTERFACE "com.canonical.dbusmenu"
+
+static gint n_menus = 20;
+static gint n_items = 100;
+static gint n_calls = 200;
+static gint depth   = -1;
+static gboolean mutate;
+static gboolean exported;
+
+static GOptionEntry entries[] = {
+	{ "menus", 'm', 0, G_OPTION_ARG_INT, &n_menus, "Top level menus", "N" },
+	{ "items", 'i', 0, G_OPTION_ARG_INT, &n_items, "Items per menu", "N" },
+	{ "calls", 'c', 0, G_OPTION_ARG_INT, &n_calls, "Number of GetLayout calls", "N" },
+	{ "depth", 'd', 0, G_OPTION_ARG_INT, &depth, "Recursion depth to ask for", "N" },
+	{ "mutate", 0, 0, G_OPTION_ARG_NONE, &mutate, "Change one item before every call", NULL },
+	{ NULL }
+};
+
+static GtkWidget *menubar_new(GtkWidget **last_item)
+{
+	GtkWidget *menubar = gtk_menu_bar_new();
+
+	for (gint i = 0; i < n_menus; i++)
+	{
+		char *label        = g_strdup_printf("Menu %d", i);
+		GtkWidget *item    = gtk_menu_item_new_with_label(label);
+		GtkWidget *submenu = gtk_menu_new();
+
+		gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), submenu);
+		gtk_container_add(GTK_CONTAINER(menubar), item);
+		g_free(label);
+
+		for (gint j = 0; j < n_items; j++)
+		{
+			label      = g_strdup_printf("Item %d.%d", i, j);
+			*last_item = gtk_menu_item_new_with_label(label);
+			gtk_container_add(GTK_CONTAINER(submenu), *last_item);
+			g_free(label);
+		}
+	}
+
+	return menubar;
+}
+
+static void on_export_complete(GtkWidget *window, gpointer user_data)
+{
+	exported = TRUE;
+}
+
+static void on_call_done(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	GVariant **reply = user_data;
+	GError *error    = NULL;
+
+	*reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &error);
+
+	if (*reply == NULL)
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		exit(1);
+	}
+}
+
+/* Calls asynchronously, the menu is exported by this very process */
+static GVariant *call(GDBusConnection *connection, const char *name, const char *path,
+                      const char *interface, const char *method, GVariant *parameters)
+{
+	GVariant *reply = NULL;
+
+	g_dbus_connection_call(connection,
+	                       name,
+	                       path,
+	                       interface,
+	                       method,
+	                       parameters,
+	                       NULL,
+	                       G_DBUS_CALL_FLAGS_NONE,
+	                       -1,
+	                       NULL,
+	                       on_call_done,
+	                       &reply);
+
+	while (reply == NULL)
+		g_main_context_iteration(NULL, TRUE);
+
+	return reply;
+}
+
+/* Finds the object path the module exported the menubar at */
+static char *find_menubar_path(GDBusConnection *connection, const char *name)
+{
+	GVariant *reply = call(connection,
+	                       name,
+	                       "/MenuBar",
+	                       "org.freedesktop.DBus.Introspectable",
+	                       "Introspect",
+	                       NULL);
+	GDBusNodeInfo *info;
+	const char *xml;
+	char *path = NULL;
+
+	g_variant_get(reply, "(&s)", &xml);
+	info = g_dbus_node_info_new_for_xml(xml, NULL);
+
+	if (info != NULL && info->nodes != NULL && info->nodes[0] != NULL)
+		path = g_strdup_printf("/MenuBar/%s", info->nodes[0]->path);
+
+	if (info != NULL)
+		g_dbus_node_info_unref(info);
+
+	g_variant_unref(reply);
+
+	return path;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context = g_option_context_new("- GetLayout benchmark");
+	GError *error           = NULL;
+	GDBusConnection *module_bus;
+	GDBusConnection *connection;
+	GtkWidget *window;
+	GtkWidget *box;
+	GtkWidget *last_item = NULL;
+	const char *name;
+	char *address;
+	char *path;
+	gint64 first = 0;
+	gint64 total = 0;
+	gsize size   = 0;
+
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gtk_get_option_group(TRUE));
+
+	if (!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	if (g_signal_lookup("appmenu-export-complete", GTK_TYPE_WINDOW) == 0)
+	{
+		g_printerr("layoutbench needs the module, run with GTK_MODULES=appmenu-gtk-module\n");
+		return 1;
+	}
+
+	/* The module exports on the shared connection, call it from a private one */
+	module_bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+	address    = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, NULL, &error);
+	connection = address == NULL ? NULL
+	                             : g_dbus_connection_new_for_address_sync(
+	                                   address,
+	                                   G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+	                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+	                                   NULL,
+	                                   NULL,
+	                                   &error);
+	g_free(address);
+
+	if (module_bus == NULL || connection == NULL)
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	name   = g_dbus_connection_get_unique_name(module_bus);
+	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	box    = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+
+	g_signal_connect(window, "appmenu-export-complete", G_CALLBACK(on_export_complete), NULL);
+	gtk_container_add(GTK_CONTAINER(window), box);
+	gtk_box_pack_start(GTK_BOX(box), menubar_new(&last_item), FALSE, FALSE, 0);
+	gtk_widget_show_all(window);
+
+	while (!exported)
+		g_main_context_iteration(NULL, TRUE);
+
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+
+	path = find_menubar_path(connection, name);
+
+	if (path == NULL)
+	{
+		g_printerr("no menubar exported under /MenuBar\n");
+		return 1;
+	}
+
+	for (gint i = 0; i < n_calls; i++)
+	{
+		GVariant *reply;
+		gint64 start;
+		gint64 elapsed;
+
+		if (mutate && last_item != NULL)
+		{
+			gtk_widget_set_sensitive(last_item, !gtk_widget_get_sensitive(last_item));
+
+			while (g_main_context_iteration(NULL, FALSE))
+				;
+		}
+
+		start   = g_get_monotonic_time();
+		reply   = call(connection,
+		               name,
+		               path,
+		               DBUSMENU_INTERFACE,
+		               "GetLayout",
+		               g_variant_new("(ii@as)", 0, depth, g_variant_new_strv(NULL, 0)));
+		elapsed = g_get_monotonic_time() - start;
+
+		if (i == 0)
+		{
+			first = elapsed;
+			size  = g_variant_get_size(reply);
+		}
+		else
+		{
+			total += elapsed;
+		}
+
+		g_variant_unref(reply);
+	}
+
+	g_print("%d items at %s: reply of %" G_GSIZE_FORMAT " bytes, first call %.3f ms",
+	        n_menus * n_items,
+	        path,
+	        size,
+	        first / 1000.0);
+
+	if (n_calls > 1)
+		g_print(", then %.3f ms per call%s",
+		        total / 1000.0 / (n_calls - 1),
+		        mutate ? " with one item changing in between" : "");
+
+	g_print("\n");
+
+	g_free(path);
+	gtk_widget_destroy(window);
+	g_object_unref(connection);
+	g_object_unref(module_bus);
+	g_option_context_free(context);
+
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Measures how long it takes to bring up windows with menubars while the
+ * module is loaded, e.g.
+ *
+ *   GTK_MODULES=appmenu-gtk-module APPMENU_GTK_EXPORT_POLICY=eager ./menubench --hidden
+ *   GTK_MODULES=appmenu-gtk-module APPMENU_GTK_EXPORT_POLICY=map ./menubench --hidden
+ *
+ * With --hidden the windows are only realized, like preference dialogs that an
+ * application prepares at startup and may never show. With --wait-export the
+ * benchmark also waits for GtkWindow::appmenu-export-complete on every window.
+ */
+
+#include <gtk/gtk.h>
+
+static gint n_windows = 20;
+static gint n_menus   = 8;
+static gint n_items   = 25;
+static gboolean hidden;
+static gboolean wait_export;
+static gint n_exported;
+
+static GOptionEntry entries[] = {
+	{ "windows", 'w', 0, G_OPTION_ARG_INT, &n_windows, "Number of windows", "N" },
+	{ "menus", 'm', 0, G_OPTION_ARG_INT, &n_menus, "Top level menus per menubar", "N" },
+	{ "items", 'i', 0, G_OPTION_ARG_INT, &n_items, "Items per menu", "N" },
+	{ "hidden", 0, 0, G_OPTION_ARG_NONE, &hidden, "Realize the windows without showing them",
+	  NULL },
+	{ "wait-export", 0, 0, G_OPTION_ARG_NONE, &wait_export,
+	  "Wait until the module has exported every menu", NULL },
+	{ NULL }
+};
+
+static GtkWidget *menubar_new(void)
+{
+	GtkWidget *menubar = gtk_menu_bar_new();
+
+	for (gint i = 0; i < n_menus; i++)
+	{
+		char *label        = g_strdup_printf("Menu %d", i);
+		GtkWidget *item    = gtk_menu_item_new_with_label(label);
+		GtkWidget *submenu = gtk_menu_new();
+
+		gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), submenu);
+		gtk_container_add(GTK_CONTAINER(menubar), item);
+		g_free(label);
+
+		for (gint j = 0; j < n_items; j++)
+		{
+			GtkWidget *child;
+
+			label = g_strdup_printf("Item %d.%d", i, j);
+			child = gtk_menu_item_new_with_label(label);
+			gtk_container_add(GTK_CONTAINER(submenu), child);
+			g_free(label);
+		}
+	}
+
+	return menubar;
+}
+
+static void on_export_complete(GtkWidget *window, gpointer user_data)
+{
+	if (g_object_get_data(G_OBJECT(window), "menubench-exported") == NULL)
+	{
+		g_object_set_data(G_OBJECT(window), "menubench-exported", window);
+		n_exported++;
+	}
+}
+
+static void drain_main_loop(void)
+{
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context = g_option_context_new("- appmenu export benchmark");
+	GError *error           = NULL;
+	GPtrArray *windows      = g_ptr_array_new_with_free_func((GDestroyNotify)gtk_widget_destroy);
+	gint64 start;
+	gint64 built;
+	gint64 done;
+	gint64 exported = 0;
+
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gtk_get_option_group(TRUE));
+
+	if (!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	if (wait_export && g_signal_lookup("appmenu-export-complete", GTK_TYPE_WINDOW) == 0)
+	{
+		g_printerr("--wait-export needs the module, run with GTK_MODULES=appmenu-gtk-module\n");
+		return 1;
+	}
+
+	start = g_get_monotonic_time();
+
+	for (gint i = 0; i < n_windows; i++)
+	{
+		GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+		GtkWidget *box    = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+
+		if (wait_export)
+			g_signal_connect(window,
+			                 "appmenu-export-complete",
+			                 G_CALLBACK(on_export_complete),
+			                 NULL);
+
+		gtk_container_add(GTK_CONTAINER(window), box);
+		gtk_box_pack_start(GTK_BOX(box), menubar_new(), FALSE, FALSE, 0);
+		gtk_widget_show_all(box);
+
+		if (hidden)
+			gtk_widget_realize(window);
+		else
+			gtk_widget_show(window);
+
+		g_ptr_array_add(windows, window);
+	}
+
+	built = g_get_monotonic_time();
+	drain_main_loop();
+	done = g_get_monotonic_time();
+
+	if (wait_export)
+	{
+		while (n_exported < n_windows)
+			g_main_context_iteration(NULL, TRUE);
+
+		exported = g_get_monotonic_time();
+	}
+
+	g_print("%d %s windows, %d menus of %d items: %.3f ms to build, %.3f ms until idle\n",
+	        n_windows,
+	        hidden ? "hidden" : "shown",
+	        n_menus,
+	        n_items,
+	        (built - start) / 1000.0,
+	        (done - start) / 1000.0);
+
+	if (wait_export)
+		g_print("all menus exported after %.3f ms\n", (exported - start) / 1000.0);
+
+	g_ptr_array_unref(windows);
+	g_option_context_free(context);
+
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Measures how long realizing windows with a menubar takes, the path where
+ * the module looks for the appmenu global of the Wayland compositor, e.g.
+ *
+ *   GDK_BACKEND=wayland GTK_MODULES=appmenu-gtk-module ./realizebench --windows 100
+ *   GDK_BACKEND=wayland ./realizebench --windows 100
+ *
+ * Run it against a compositor without org_kde_kwin_appmenu_manager (GNOME,
+ * sway, weston) to see what the module costs there. Every window is realized
+ * on its own and the main loop runs in between, like windows an application
+ * opens one after another.
+ *
+ * For the latency from realize until the menubar is announced, run it under
+ * tests/compositor/run.sh with G_MESSAGES_DEBUG=all and compare the
+ * "announced ... after realize" lines of the module, or the "surface to
+ * set_address" summary of the compositor, between two builds of the module.
+ * tests/compositor/latency.sh does both runs and prints the two summaries.
+ */
+
+#include <gtk/gtk.h>
+
+static gint n_windows = 100;
+
+static GOptionEntry entries[] = {
+	{ "windows", 'w', 0, G_OPTION_ARG_INT, &n_windows, "Number of windows to realize", "N" },
+	{ NULL }
+};
+
+static GtkWidget *window_new(gint index)
+{
+	GtkWidget *window  = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	GtkWidget *box     = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+	GtkWidget *menubar = gtk_menu_bar_new();
+	char *title        = g_strdup_printf("Window %d", index);
+
+	for (gint i = 0; i < 4; i++)
+	{
+		char *label     = g_strdup_printf("Menu %d", i);
+		GtkWidget *item = gtk_menu_item_new_with_label(label);
+
+		gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), gtk_menu_new());
+		gtk_container_add(GTK_CONTAINER(menubar), item);
+		g_free(label);
+	}
+
+	gtk_window_set_title(GTK_WINDOW(window), title);
+	gtk_container_add(GTK_CONTAINER(window), box);
+	gtk_box_pack_start(GTK_BOX(box), menubar, FALSE, FALSE, 0);
+	g_free(title);
+
+	return window;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context = g_option_context_new("- window realize benchmark");
+	GError *error           = NULL;
+	GtkWidget **windows;
+	gint64 slowest = 0;
+	gint64 total   = 0;
+
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gtk_get_option_group(TRUE));
+
+	if (!g_option_context_parse(context, &argc, &argv, &error) || n_windows < 1)
+	{
+		g_printerr("%s\n", error != NULL ? error->message : "--windows must be positive");
+		return 1;
+	}
+
+	windows = g_new0(GtkWidget *, n_windows);
+
+	for (gint i = 0; i < n_windows; i++)
+	{
+		gint64 start;
+		gint64 elapsed;
+
+		windows[i] = window_new(i);
+		start      = g_get_monotonic_time();
+		gtk_widget_show_all(windows[i]);
+		elapsed = g_get_monotonic_time() - start;
+
+		total += elapsed;
+		slowest = MAX(slowest, elapsed);
+
+		while (g_main_context_iteration(NULL, FALSE))
+			;
+	}
+
+	g_print("%d windows on %s: %.3f ms, %.3f ms per window, slowest %.3f ms\n",
+	        n_windows,
+	        G_OBJECT_TYPE_NAME(gdk_display_get_default()),
+	        total / 1000.0,
+	        total / 1000.0 / n_windows,
+	        slowest / 1000.0);
+
+	for (gint i = 0; i < n_windows; i++)
+		gtk_widget_destroy(windows[i]);
+
+	g_free(windows);
+	g_option_context_free(context);
+
+	return 0;
+}
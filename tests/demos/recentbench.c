@@ -0,0 +1,206 @@
+/*
+ * Measures what an application rebuilding its recent files submenu costs the
+ * exported menu, e.g.
+ *
+ *   GTK_MODULES=appmenu-gtk-module ./recentbench --entries 200 --rounds 20
+ *
+ * Every round destroys all items of File > Open Recent and adds them again,
+ * with one new file at the top and the oldest one dropped (or the very same
+ * files with --same). The benchmark reports how long the module takes to
+ * settle and how many LayoutUpdated and ItemsPropertiesUpdated signals it
+ * emitted for the round.
+ */
+
+#include <gtk/gtk.h>
+
+#define DBUSMENU_INTERFACE "com.canonical.dbusmenu"
+
+static gint n_entries = 200;
+static gint n_rounds  = 20;
+static gboolean same;
+static gboolean exported;
+static guint n_layout_updated;
+static guint n_properties_updated;
+
+static GOptionEntry entries[] = {
+	{ "entries", 'e', 0, G_OPTION_ARG_INT, &n_entries, "Number of recent files", "N" },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &n_rounds, "Number of rebuilds", "N" },
+	{ "same", 0, 0, G_OPTION_ARG_NONE, &same, "Rebuild with the same files every round", NULL },
+	{ NULL }
+};
+
+static void fill_recent_menu(GtkWidget *menu, gint first)
+{
+	/* Newest first, like GtkRecentChooserMenu */
+	for (gint i = first + n_entries - 1; i >= first; i--)
+	{
+		char *label     = g_strdup_printf("document-%d.txt", i);
+		GtkWidget *item = gtk_menu_item_new_with_label(label);
+
+		gtk_widget_show(item);
+		gtk_container_add(GTK_CONTAINER(menu), item);
+		g_free(label);
+	}
+}
+
+static void on_export_complete(GtkWidget *window, gpointer user_data)
+{
+	exported = TRUE;
+}
+
+static void on_dbusmenu_signal(GDBusConnection *connection, const char *sender_name,
+                               const char *object_path, const char *interface_name,
+                               const char *signal_name, GVariant *parameters,
+                               gpointer user_data)
+{
+	if (g_strcmp0(signal_name, "LayoutUpdated") == 0)
+		n_layout_updated++;
+	else if (g_strcmp0(signal_name, "ItemsPropertiesUpdated") == 0)
+		n_properties_updated++;
+}
+
+static gboolean on_quiet_timeout(gpointer user_data)
+{
+	*(gboolean *)user_data = TRUE;
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Runs the main loop until it is idle and the bus had time to deliver */
+static void settle(void)
+{
+	gboolean quiet = FALSE;
+
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+
+	g_timeout_add(100, on_quiet_timeout, &quiet);
+
+	while (!quiet)
+		g_main_context_iteration(NULL, TRUE);
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context = g_option_context_new("- recent files rebuild benchmark");
+	GError *error           = NULL;
+	GDBusConnection *connection;
+	GtkWidget *window;
+	GtkWidget *box;
+	GtkWidget *menubar;
+	GtkWidget *file_item;
+	GtkWidget *file_menu;
+	GtkWidget *recent_item;
+	GtkWidget *recent_menu;
+	gint64 total  = 0;
+	guint layouts = 0;
+	guint props   = 0;
+	guint subscription;
+
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gtk_get_option_group(TRUE));
+
+	if (!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	if (g_signal_lookup("appmenu-export-complete", GTK_TYPE_WINDOW) == 0)
+	{
+		g_printerr("recentbench needs the module, run with GTK_MODULES=appmenu-gtk-module\n");
+		return 1;
+	}
+
+	connection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+
+	if (connection == NULL)
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	subscription = g_dbus_connection_signal_subscribe(connection,
+	                                                  g_dbus_connection_get_unique_name(
+	                                                      connection),
+	                                                  DBUSMENU_INTERFACE,
+	                                                  NULL,
+	                                                  NULL,
+	                                                  NULL,
+	                                                  G_DBUS_SIGNAL_FLAGS_NONE,
+	                                                  on_dbusmenu_signal,
+	                                                  NULL,
+	                                                  NULL);
+
+	window      = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	box         = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+	menubar     = gtk_menu_bar_new();
+	file_item   = gtk_menu_item_new_with_mnemonic("_File");
+	file_menu   = gtk_menu_new();
+	recent_item = gtk_menu_item_new_with_mnemonic("Open _Recent");
+	recent_menu = gtk_menu_new();
+
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(file_item), file_menu);
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(recent_item), recent_menu);
+	gtk_container_add(GTK_CONTAINER(menubar), file_item);
+	gtk_container_add(GTK_CONTAINER(file_menu), gtk_menu_item_new_with_mnemonic("_Open"));
+	gtk_container_add(GTK_CONTAINER(file_menu), recent_item);
+	gtk_container_add(GTK_CONTAINER(file_menu), gtk_menu_item_new_with_mnemonic("_Quit"));
+	fill_recent_menu(recent_menu, 0);
+
+	g_signal_connect(window, "appmenu-export-complete", G_CALLBACK(on_export_complete), NULL);
+	gtk_container_add(GTK_CONTAINER(window), box);
+	gtk_box_pack_start(GTK_BOX(box), menubar, FALSE, FALSE, 0);
+	gtk_widget_show_all(window);
+
+	while (!exported)
+		g_main_context_iteration(NULL, TRUE);
+
+	settle();
+
+	for (gint round = 1; round <= n_rounds; round++)
+	{
+		GList *children = gtk_container_get_children(GTK_CONTAINER(recent_menu));
+		gint64 start;
+		gint64 done;
+
+		n_layout_updated     = 0;
+		n_properties_updated = 0;
+		start                = g_get_monotonic_time();
+
+		g_list_free_full(children, (GDestroyNotify)gtk_widget_destroy);
+		fill_recent_menu(recent_menu, same ? 0 : round);
+
+		while (g_main_context_iteration(NULL, FALSE))
+			;
+
+		done = g_get_monotonic_time();
+		settle();
+
+		g_print("round %2d: %8.3f ms, %u LayoutUpdated, %u ItemsPropertiesUpdated\n",
+		        round,
+		        (done - start) / 1000.0,
+		        n_layout_updated,
+		        n_properties_updated);
+
+		total += done - start;
+		layouts += n_layout_updated;
+		props += n_properties_updated;
+	}
+
+	if (n_rounds > 0)
+		g_print("%d entries, %d rounds: %.3f ms, %.1f LayoutUpdated and %.1f "
+		        "ItemsPropertiesUpdated per rebuild\n",
+		        n_entries,
+		        n_rounds,
+		        total / 1000.0 / n_rounds,
+		        (double)layouts / n_rounds,
+		        (double)props / n_rounds);
+
+	g_dbus_connection_signal_unsubscribe(connection, subscription);
+	g_object_unref(connection);
+	gtk_widget_destroy(window);
+	g_option_context_free(context);
+
+	return 0;
+}
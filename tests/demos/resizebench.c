@@ -0,0 +1,113 @@
+/*
+ * Measures the size negotiation of a window with a menubar during a resize
+ * storm, where the hijacked size request and allocation of the menubar run
+ * for every frame, e.g.
+ *
+ *   GTK_MODULES=appmenu-gtk-module ./resizebench --rounds 2000
+ *
+ * Every round invalidates the size of the menubar, asks for its preferred
+ * sizes like a container would and allocates it. With --window the window
+ * itself is resized back and forth instead and the main loop runs until the
+ * new size is laid out.
+ */
+
+#include <gtk/gtk.h>
+
+static gint n_rounds = 2000;
+static gboolean resize_window;
+
+static GOptionEntry entries[] = {
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &n_rounds, "Number of resizes", "N" },
+	{ "window", 'w', 0, G_OPTION_ARG_NONE, &resize_window, "Resize the toplevel window", NULL },
+	{ NULL }
+};
+
+static GtkWidget *menubar_new(void)
+{
+	GtkWidget *menubar = gtk_menu_bar_new();
+
+	for (gint i = 0; i < 8; i++)
+	{
+		char *label     = g_strdup_printf("Menu %d", i);
+		GtkWidget *item = gtk_menu_item_new_with_label(label);
+
+		gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), gtk_menu_new());
+		gtk_container_add(GTK_CONTAINER(menubar), item);
+		g_free(label);
+	}
+
+	return menubar;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context = g_option_context_new("- menubar resize benchmark");
+	GError *error           = NULL;
+	GtkWidget *window;
+	GtkWidget *box;
+	GtkWidget *menubar;
+	gint64 start;
+	gint64 elapsed;
+
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gtk_get_option_group(TRUE));
+
+	if (!g_option_context_parse(context, &argc, &argv, &error) || n_rounds < 1)
+	{
+		g_printerr("%s\n", error != NULL ? error->message : "--rounds must be positive");
+		return 1;
+	}
+
+	window  = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	box     = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+	menubar = menubar_new();
+
+	gtk_container_add(GTK_CONTAINER(window), box);
+	gtk_box_pack_start(GTK_BOX(box), menubar, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(box), gtk_label_new("Content"), TRUE, TRUE, 0);
+	gtk_window_set_default_size(GTK_WINDOW(window), 640, 480);
+	gtk_widget_show_all(window);
+
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+
+	start = g_get_monotonic_time();
+
+	for (gint i = 0; i < n_rounds; i++)
+	{
+		gint width = 640 + (i % 2 == 0 ? 1 : -1) * (i % 64);
+
+		if (resize_window)
+		{
+			gtk_window_resize(GTK_WINDOW(window), width, 480);
+
+			while (g_main_context_iteration(NULL, FALSE))
+				;
+		}
+		else
+		{
+			GtkAllocation allocation = { 0, 0, width, 0 };
+			gint minimum;
+			gint natural;
+
+			gtk_widget_queue_resize(menubar);
+			gtk_widget_get_preferred_width(menubar, &minimum, &natural);
+			gtk_widget_get_preferred_height_for_width(menubar, width, &minimum, &natural);
+			allocation.height = natural;
+			gtk_widget_size_allocate(menubar, &allocation);
+		}
+	}
+
+	elapsed = g_get_monotonic_time() - start;
+
+	g_print("%d %s: %.3f ms, %.2f us per resize\n",
+	        n_rounds,
+	        resize_window ? "window resizes" : "menubar size negotiations",
+	        elapsed / 1000.0,
+	        (double)elapsed / n_rounds);
+
+	gtk_widget_destroy(window);
+	g_option_context_free(context);
+
+	return 0;
+}
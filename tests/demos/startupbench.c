@@ -0,0 +1,125 @@
+/*
+ * Measures how much time loading the module adds to gtk_init(). The benchmark
+ * runs itself repeatedly, once with GTK_MODULES set and once without, and
+ * compares the time gtk_init() took in the children, e.g.
+ *
+ *   ./startupbench --runs 50
+ *
+ * Pointing DBUS_SESSION_BUS_ADDRESS at a socket nobody answers on shows what
+ * an application launch costs while dbus-daemon is wedged.
+ */
+
+#include <gtk/gtk.h>
+
+static gint n_runs  = 20;
+static char *module = "appmenu-gtk-module";
+
+static GOptionEntry entries[] = {
+	{ "runs", 'r', 0, G_OPTION_ARG_INT, &n_runs, "Number of runs per configuration", "N" },
+	{ "module", 'm', 0, G_OPTION_ARG_STRING, &module, "Module to load", "NAME" },
+	{ NULL }
+};
+
+/* Runs the benchmark as a child and returns the microseconds gtk_init() took */
+static gint64 run_child(const char *self, const char *modules)
+{
+	char *argv[]    = { (char *)self, "--child", NULL };
+	char **envp     = g_get_environ();
+	char *output    = NULL;
+	GError *error   = NULL;
+	gint64 duration = -1;
+	gint status;
+
+	if (modules != NULL)
+		envp = g_environ_setenv(envp, "GTK_MODULES", modules, TRUE);
+	else
+		envp = g_environ_unsetenv(envp, "GTK_MODULES");
+
+	if (!g_spawn_sync(NULL,
+	                  argv,
+	                  envp,
+	                  G_SPAWN_SEARCH_PATH,
+	                  NULL,
+	                  NULL,
+	                  &output,
+	                  NULL,
+	                  &status,
+	                  &error))
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+	}
+	else if (output != NULL && g_spawn_check_exit_status(status, NULL))
+	{
+		duration = g_ascii_strtoll(output, NULL, 10);
+	}
+
+	g_free(output);
+	g_strfreev(envp);
+
+	return duration;
+}
+
+static gboolean measure(const char *self, const char *modules, double *average)
+{
+	gint64 total = 0;
+
+	for (gint i = 0; i < n_runs; i++)
+	{
+		gint64 duration = run_child(self, modules);
+
+		if (duration < 0)
+			return FALSE;
+
+		total += duration;
+	}
+
+	*average = total / 1000.0 / n_runs;
+
+	return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	double without;
+	double with;
+	gint64 start;
+
+	/* In the child only gtk_init() itself is timed */
+	if (argc > 1 && g_strcmp0(argv[1], "--child") == 0)
+	{
+		start = g_get_monotonic_time();
+		gtk_init(&argc, &argv);
+		g_print("%" G_GINT64_FORMAT "\n", g_get_monotonic_time() - start);
+
+		return 0;
+	}
+
+	context = g_option_context_new("- gtk_init startup benchmark");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error) || n_runs < 1)
+	{
+		g_printerr("%s\n", error != NULL ? error->message : "--runs must be positive");
+		return 1;
+	}
+
+	if (!measure(argv[0], NULL, &without) || !measure(argv[0], module, &with))
+	{
+		g_printerr("a child run failed\n");
+		return 1;
+	}
+
+	g_print("gtk_init over %d runs: %.3f ms without modules, %.3f ms with %s, +%.3f ms\n",
+	        n_runs,
+	        without,
+	        with,
+	        module,
+	        with - without);
+
+	g_option_context_free(context);
+
+	return 0;
+}